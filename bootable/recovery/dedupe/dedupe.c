@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 #include <openssl/ripemd.h>
@@ -7,176 +10,335 @@
 #include <dirent.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <zlib.h>
 
-typedef struct DEDUPE_STORE_CONTEXT {
+#include "dedupe.h"
+
+// Files up to this size are hashed in memory; larger ones are chunked.
+// A file that grows past it after being listed is staged in a
+// temporary blob while it is hashed.
+#define DEDUPE_BUFFER_SIZE (1024 * 1024)
+#define DEDUPE_MAX_THREADS 8
+
+// Chunks average 64KB, the mask having 16 bits set.
+#define DEDUPE_CHUNK_MIN (16 * 1024)
+#define DEDUPE_CHUNK_MAX (256 * 1024)
+#define DEDUPE_CHUNK_MASK 0xffff0000
+#define DEDUPE_CHUNK_FILE_MIN (2 * DEDUPE_CHUNK_MAX)
+
+// Writing to the card is what takes the time, so the fastest level
+// already gets most of the benefit.
+#define DEDUPE_COMPRESS_LEVEL Z_BEST_SPEED
+#define DEDUPE_COMPRESSED_SUFFIX ".z"
+#define DEDUPE_ZBUF_SIZE (64 * 1024)
+
+// The digests of every blob in the store.  The blob directory is read
+// once per run, so finding out that a blob is already stored costs no
+// filesystem access at all.
+struct KNOWN_BLOBS {
+    unsigned char *digests;     // capacity slots of SHA256_DIGEST_LENGTH
+    char *used;
+    int count;
+    int capacity;
+};
+
+// An entry of a manifest.
+struct DEDUPE_ENTRY {
+    char type;
+    struct stat st;             // mode, uid, gid and size of the entry
+    char name[PATH_MAX];        // relative to the tree ("./app/...")
+    char data[PATH_MAX];        // blob digest or symlink target
+};
+
+struct DEDUPE_POOL;
+struct MANIFEST_WRITER;
+
+struct DEDUPE_STORE_CONTEXT {
     char blob_dir[PATH_MAX];
+    pthread_mutex_t mutex;      // guards known and the counters
+    struct KNOWN_BLOBS known;
+    int blobs_written;
+    int blobs_reused;
+    int flags;
+    struct DEDUPE_POOL *pool;
+    const char *input_directory;
+    const char **excludes;
     FILE *output_manifest;
+    struct MANIFEST_WRITER *writer;     // binary manifests only
+    dedupe_callback callback;
+    void *cookie;
+    uint64_t bytes;
 };
 
 static void usage(char** argv) {
-    fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest\n", argv[0]);
-    fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
+    fprintf(stderr, "usage: %s [-j threads] [-C] [-z] [-B] c input_directory blob_dir output_manifest\n", argv[0]);
+    fprintf(stderr, "usage: %s [-j threads] [-p path] x input_manifest blob_dir output_directory\n", argv[0]);
+    fprintf(stderr, "usage: %s [-p path] cat manifest\n", argv[0]);
+    fprintf(stderr, "usage: %s pack input_manifest output_manifest\n", argv[0]);
+    fprintf(stderr, "usage: %s [-n] gc blob_dir manifest...\n", argv[0]);
+    fprintf(stderr, "usage: %s migrate blob_dir\n", argv[0]);
+    fprintf(stderr, "usage: %s [-j threads] verify blob_dir [manifest...]\n", argv[0]);
 }
 
-static int copy_file(const char *dst, const char *src) {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
-    if (src == NULL)
-        return 1;
-    if (dst == NULL)
-        return 2;
-    
-    srcfd = open(src, O_RDONLY);
-    if (srcfd < 0)
-        return 3;
-
-    dstfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0600);
-    if (dstfd < 0) {
-        close(srcfd);
-        return 4;
-    }
-
-    while (bytes_read = read(srcfd, buf, 4096)) {
-        total_read += bytes_read;
-        if (write(dstfd, buf, bytes_read) != bytes_read)
-            return 5;
+static int write_fully(int fd, const char *data, int len) {
+    while (len > 0) {
+        int bytes_written = write(fd, data, len);
+        if (bytes_written < 0 && errno == EINTR)
+            continue;
+        if (bytes_written <= 0)
+            return -1;
+        data += bytes_written;
+        len -= bytes_written;
     }
-
-    close(dstfd);
-    close(srcfd);
-    
     return 0;
 }
 
-static void do_sha256sum(FILE *mfile, unsigned char *rptr) {
-    char rdata[BUFSIZ];
-    int rsize;
-    SHA256_CTX c;
-    
-    SHA256_Init(&c);
-    while(!feof(mfile)) {
-        rsize = fread(rdata, sizeof(char), BUFSIZ, mfile);
-        if(rsize > 0) {
-            SHA256_Update(&c, rdata, rsize);
-        }
+// Returns the number of bytes read, short only at end of file.
+static int read_fully(int fd, char *data, int len) {
+    int total = 0;
+    while (total < len) {
+        int bytes_read = read(fd, data + total, len - total);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0)
+            return -1;
+        if (bytes_read == 0)
+            break;
+        total += bytes_read;
     }
+    return total;
+}
+
+static void sha256_to_string(const unsigned char *sumdata, char *psum) {
+    int j;
+    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
+        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
+    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
+}
 
-    SHA256_Final(rptr, &c);
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
 }
 
-static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "Unable to open file: %s\n", filename);
-        return 1;
+static int string_to_sha256(const char *psum, unsigned char *sumdata) {
+    int j;
+    for (j = 0; j < SHA256_DIGEST_LENGTH; j++) {
+        int hi = hex_value(psum[j * 2]);
+        int lo = hex_value(psum[j * 2 + 1]);
+        if (hi < 0 || lo < 0)
+            return 1;
+        sumdata[j] = (hi << 4) | lo;
     }
-    do_sha256sum(f, rptr);
-    fclose(f);
-    return 0;
+    return psum[SHA256_DIGEST_LENGTH * 2] != '\0';
 }
 
-static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
+/*
+ * Blobs live in one subdirectory per first byte of their digest,
+ * blob_dir/ab/ab..., which keeps directories small enough for vfat to
+ * search quickly.  Older stores kept every blob in blob_dir itself;
+ * those are still read, and dedupe migrate moves them into place.
+ */
+static void get_blob_path(const char *blob_dir, const char *name, char *out) {
+    snprintf(out, PATH_MAX, "%s/%.2s/%s", blob_dir, name, name);
+}
 
-void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, const char *f) {
-    fprintf(context->output_manifest, "%c\t%o\t%d\t%d\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, f);
+// Blobs stored compressed have DEDUPE_COMPRESSED_SUFFIX after the
+// digest in their name.  Returns 0 if name is that of a blob.
+static int parse_blob_name(const char *name, unsigned char *sumdata, int *compressed) {
+    char psum[SHA256_DIGEST_LENGTH * 2 + 1];
+    if (strlen(name) < sizeof(psum) - 1)
+        return 1;
+    memcpy(psum, name, sizeof(psum) - 1);
+    psum[sizeof(psum) - 1] = '\0';
+    const char *suffix = name + sizeof(psum) - 1;
+    *compressed = strcmp(suffix, DEDUPE_COMPRESSED_SUFFIX) == 0;
+    if (*suffix != '\0' && !*compressed)
+        return 1;
+    return string_to_sha256(psum, sumdata);
 }
 
-static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
-    printf("%s\n", f);
-    unsigned char sumdata[SHA256_DIGEST_LENGTH];
-    int ret;
-    if (ret = do_sha256sum_file(f, sumdata)) {
-        fprintf(stderr, "Error calculating sha256sum of %s\n", f);
-        return ret; 
+static int open_blob(const char *blob_dir, const char *psum, int *compressed) {
+    char name[PATH_MAX];
+    char blob_file[PATH_MAX];
+    int layout;
+    for (layout = 0; layout < 4; layout++) {
+        *compressed = layout & 1;
+        snprintf(name, sizeof(name), "%s%s", psum, *compressed ? DEDUPE_COMPRESSED_SUFFIX : "");
+        if (layout < 2)
+            get_blob_path(blob_dir, name, blob_file);
+        else
+            snprintf(blob_file, sizeof(blob_file), "%s/%s", blob_dir, name);
+        int fd = open(blob_file, O_RDONLY);
+        if (fd >= 0 || errno != ENOENT)
+            return fd;
     }
-    char psum[128];
-    int j;
-    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
-        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
-    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
+    return -1;
+}
 
-    char out_blob[PATH_MAX];
-    sprintf(out_blob, "%s/%s", context->blob_dir, psum);
-    if (ret = copy_file(out_blob, f)) {
-        fprintf(stderr, "Error copying blob %s\n", f);
-        return ret;
-    }
-    
-    fprintf(context->output_manifest, "%s\t%d\t\n", psum, st.st_size);
-    return 0;
+// Move a complete blob to its place in the store, creating its
+// subdirectory on first use.  name is the file name of the blob.
+static int move_blob(const char *from, const char *blob_dir, const char *name) {
+    char blob_file[PATH_MAX];
+    get_blob_path(blob_dir, name, blob_file);
+    if (rename(from, blob_file) == 0)
+        return 0;
+    if (errno != ENOENT)
+        return 1;
+    char shard_dir[PATH_MAX];
+    snprintf(shard_dir, sizeof(shard_dir), "%s/%.2s", blob_dir, name);
+    if (mkdir(shard_dir, 0777) && errno != EEXIST)
+        return 1;
+    return rename(from, blob_file) != 0;
 }
 
-static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
-    printf("%s\n", d);
-    DIR *dp = opendir(d);
-    if (d == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", d);
+static int is_shard_name(const char *name) {
+    return strlen(name) == 2 && hex_value(name[0]) >= 0 && hex_value(name[1]) >= 0;
+}
+
+// Invoked with every file in the store, in either layout, including
+// temporary blobs.
+typedef int (*blob_visitor)(void *cookie, const char *path, const char *name);
+
+static int visit_blob_dir(const char *dir, int top, blob_visitor visit, void *cookie) {
+    DIR *dp = opendir(dir);
+    if (dp == NULL) {
+        fprintf(stderr, "Unable to read blob directory %s\n", dir);
         return 1;
     }
     struct dirent *ep;
-    char full_path[PATH_MAX];
-    while (ep = readdir(dp)) {
-        if (strcmp(ep->d_name, ".") == 0)
-            continue;
-        if (strcmp(ep->d_name, "..") == 0)
+    char path[PATH_MAX];
+    int ret = 0;
+    while (ret == 0 && (ep = readdir(dp))) {
+        if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
             continue;
-        struct stat cst;
-        int ret;
-        sprintf(full_path, "%s/%s", d, ep->d_name);
-        if (0 != (ret = lstat(full_path, &cst))) {
-            fprintf(stderr, "Error opening: %s\n", ep->d_name);
-            closedir(dp);
-            return ret;
-        }
-        
-        if (ret = store_st(context, cst, full_path))
-            return ret;
+        snprintf(path, sizeof(path), "%s/%s", dir, ep->d_name);
+        if (top && is_shard_name(ep->d_name))
+            ret = visit_blob_dir(path, 0, visit, cookie);
+        else
+            ret = visit(cookie, path, ep->d_name);
     }
     closedir(dp);
-    return 0;
+    return ret;
 }
 
-static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* l) {
-    printf("%s\n", l);
-    char link[PATH_MAX];
-    int ret = readlink(l, link, PATH_MAX);
-    if (ret < 0) {
-        fprintf(stderr, "Error reading symlink\n");
-        return errno;
-    }
-    link[ret] = '\0';
-    fprintf(context->output_manifest, "%s\t\n", link);
-    return 0;
+static int for_each_blob(const char *blob_dir, blob_visitor visit, void *cookie) {
+    return visit_blob_dir(blob_dir, 1, visit, cookie);
 }
 
-static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
-    if (S_ISREG(st.st_mode)) {
-        print_stat(context, 'f', st, s);
-        return store_file(context, st, s);
+// Stores hold a shared lock on <blob_dir>/.lock while they run and gc
+// an exclusive one, so gc never removes the temporary blobs of a store
+// in progress, or new blobs whose manifest isn't written yet.  Returns
+// the descriptor holding the lock, or -1.
+static int lock_blob_dir(const char *blob_dir, int operation) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.lock", blob_dir);
+    int fd = open(path, O_RDONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (flock(fd, operation)) {
+        close(fd);
+        return -1;
     }
-    else if (S_ISDIR(st.st_mode)) {
-        print_stat(context, 'd', st, s);
-        fprintf(context->output_manifest, "\n");
-        return store_dir(context, st, s);
+    return fd;
+}
+
+// Returns the slot holding digest, or the empty slot it belongs in.
+static int known_blobs_slot(struct KNOWN_BLOBS *known, const unsigned char *digest) {
+    // the digest is as good a hash as any
+    unsigned int i;
+    memcpy(&i, digest, sizeof(i));
+    i &= known->capacity - 1;
+    while (known->used[i] &&
+            memcmp(known->digests + i * SHA256_DIGEST_LENGTH, digest, SHA256_DIGEST_LENGTH) != 0)
+        i = (i + 1) & (known->capacity - 1);
+    return i;
+}
+
+static int known_blobs_contains(struct KNOWN_BLOBS *known, const unsigned char *digest) {
+    return known->capacity > 0 && known->used[known_blobs_slot(known, digest)];
+}
+
+static int known_blobs_add(struct KNOWN_BLOBS *known, const unsigned char *digest) {
+    // keep the table at most half full
+    if ((known->count + 1) * 2 > known->capacity) {
+        struct KNOWN_BLOBS grown;
+        grown.count = 0;
+        grown.capacity = known->capacity == 0 ? 1024 : known->capacity * 2;
+        grown.digests = malloc(grown.capacity * SHA256_DIGEST_LENGTH);
+        grown.used = calloc(grown.capacity, 1);
+        if (grown.digests == NULL || grown.used == NULL) {
+            free(grown.digests);
+            free(grown.used);
+            return 1;
+        }
+        int i;
+        for (i = 0; i < known->capacity; i++) {
+            if (known->used[i])
+                known_blobs_add(&grown, known->digests + i * SHA256_DIGEST_LENGTH);
+        }
+        free(known->digests);
+        free(known->used);
+        *known = grown;
     }
-    else if (S_ISLNK(st.st_mode)) {
-        print_stat(context, 'l', st, s);
-        return store_link(context, st, s);
+    int slot = known_blobs_slot(known, digest);
+    if (!known->used[slot]) {
+        memcpy(known->digests + slot * SHA256_DIGEST_LENGTH, digest, SHA256_DIGEST_LENGTH);
+        known->used[slot] = 1;
+        known->count++;
     }
-    else {
-        fprintf(stderr, "Skipping special: %s\n", s);
+    return 0;
+}
+
+static int known_blobs_visit(void *cookie, const char *path, const char *name) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int compressed;
+    if (parse_blob_name(name, digest, &compressed) != 0)
         return 0;
-    }
+    return known_blobs_add((struct KNOWN_BLOBS *)cookie, digest);
 }
 
-void get_full_path(char *out_path, char *rel_path) {
-    char tmp[PATH_MAX];
-    getcwd(tmp, PATH_MAX);
-    chdir(rel_path);
-    getcwd(out_path, PATH_MAX);
-    chdir(tmp);
+static int known_blobs_load(struct KNOWN_BLOBS *known, const char *blob_dir) {
+    struct stat st;
+    if (stat(blob_dir, &st) != 0)
+        return errno == ENOENT ? 0 : 1;
+    return for_each_blob(blob_dir, known_blobs_visit, known);
+}
+
+static void known_blobs_free(struct KNOWN_BLOBS *known) {
+    free(known->digests);
+    free(known->used);
+    memset(known, 0, sizeof(*known));
+}
+
+// Entries are recorded relative to the input directory ("./app/..."),
+// and opened through the full path, so the working directory of the
+// process is never changed.
+static void get_input_path(struct DEDUPE_STORE_CONTEXT *context, char *out, const char *rel) {
+    snprintf(out, PATH_MAX, "%s/%s", context->input_directory, rel);
+}
+
+static int is_excluded(struct DEDUPE_STORE_CONTEXT *context, const char *rel) {
+    const char **exclude;
+    if (context->excludes == NULL)
+        return 0;
+    // skip the leading "./"
+    for (exclude = context->excludes; *exclude != NULL; exclude++) {
+        if (strcmp(rel + 2, *exclude) == 0)
+            return 1;
+    }
+    return 0;
 }
 
 static char* tokenize(char *out, const char* line, const char sep) {
@@ -184,12 +346,12 @@ static char* tokenize(char *out, const char* line, const char sep) {
         if (*line == '\0') {
             return NULL;
         }
-        
+
         *out = *line;
         out++;
         line++;
     }
-    
+
     *out = '\0';
     // resume at the next char
     return ++line;
@@ -204,124 +366,1817 @@ static int dec_to_oct(int dec) {
         dec /= 10;
         mult *= 8;
     }
-    
+
     return ret;
 }
 
-int main(int argc, char** argv) {
-    if (argc != 5) {
-        usage(argv);
+/*
+ * Manifests come in two forms.  The text form has a line per entry, in
+ * tree order:
+ *
+ *   type  mode  uid  gid  name  [digest  size | link target]
+ *
+ * separated by tabs, mode in octal.  The binary form holds the same
+ * entries as fixed size records sorted by name, followed by a table of
+ * the NUL terminated names and link targets.  Sorting keeps every
+ * directory ahead of its contents, and lets a name or a subtree be
+ * found by binary search in the mapped file.  All fields are in host
+ * byte order.
+ */
+#define DEDUPE_MANIFEST_MAGIC   0x424d4444      // "DDMB"
+#define DEDUPE_MANIFEST_VERSION 1
+
+struct DEDUPE_MANIFEST_HEADER {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t record_size;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct DEDUPE_RECORD {
+    uint32_t name;              // offsets into the string table
+    uint32_t link;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint8_t type;
+    uint8_t reserved[3];
+    uint64_t size;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+};
+
+// Reads either form.  A binary manifest can be limited to a subtree.
+struct MANIFEST_READER {
+    FILE *text;
+    char *map;
+    size_t map_size;
+    const struct DEDUPE_RECORD *records;
+    const char *strings;
+    uint32_t count;
+    uint32_t next;              // next record
+    uint32_t end;               // end of the records to read
+    int exact;                  // record naming the subtree itself, or -1
+    const char *subtree;        // text manifests skip everything else
+};
+
+static int manifest_open(struct MANIFEST_READER *reader, const char *manifest) {
+    memset(reader, 0, sizeof(*reader));
+    reader->exact = -1;
+    int fd = open(manifest, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open input manifest %s\n", manifest);
         return 1;
     }
 
-    if (strcmp(argv[1], "c") == 0) {
-        struct stat st;
-        int ret;
-        if (0 != (ret = lstat(argv[2], &st))) {
-            fprintf(stderr, "Error opening input_file/input_directory.\n");
-            return ret;
-        }
-        
-        if (!S_ISDIR(st.st_mode)) {
-            fprintf(stderr, "%s must be a directory.\n", argv[2]);
+    struct DEDUPE_MANIFEST_HEADER header;
+    struct stat st;
+    if (read_fully(fd, (char *)&header, sizeof(header)) != sizeof(header) ||
+            header.magic != DEDUPE_MANIFEST_MAGIC) {
+        close(fd);
+        reader->text = fopen(manifest, "rb");
+        if (reader->text == NULL) {
+            fprintf(stderr, "Unable to open input manifest %s\n", manifest);
             return 1;
         }
-        
-        char blob_dir[PATH_MAX];
-        struct DEDUPE_STORE_CONTEXT context;
-        context.output_manifest = fopen(argv[4], "wb");
-        if (context.output_manifest == NULL) {
-            fprintf(stderr, "Unable to open output file %s\n", argv[4]);
-            return 1;
-        }
-        get_full_path(context.blob_dir, argv[3]);
-        chdir(argv[2]);
-        
-        return store_dir(&context, st, ".");
-    }
-    else if (strcmp(argv[1], "x") == 0) {
-        FILE *input_manifest = fopen(argv[2], "rb");
-        if (input_manifest == NULL) {
-            fprintf(stderr, "Unable to open input manifest %s\n", argv[2]);
+        return 0;
+    }
+
+    if (fstat(fd, &st) != 0 || header.version != DEDUPE_MANIFEST_VERSION ||
+            header.record_size != sizeof(struct DEDUPE_RECORD) ||
+            sizeof(header) + (uint64_t)header.count * header.record_size > header.strings_offset ||
+            header.strings_size == 0 ||
+            header.strings_offset + header.strings_size != (uint64_t)st.st_size) {
+        fprintf(stderr, "Unsupported or damaged manifest %s\n", manifest);
+        close(fd);
+        return 1;
+    }
+    reader->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (reader->map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map manifest %s\n", manifest);
+        return 1;
+    }
+    reader->map_size = st.st_size;
+    reader->records = (const struct DEDUPE_RECORD *)(reader->map + sizeof(header));
+    reader->strings = reader->map + header.strings_offset;
+    reader->count = header.count;
+    reader->end = header.count;
+    // every string is terminated if the table is
+    if (reader->strings[header.strings_size - 1] != '\0') {
+        fprintf(stderr, "Unsupported or damaged manifest %s\n", manifest);
+        munmap(reader->map, reader->map_size);
+        return 1;
+    }
+    uint32_t i;
+    for (i = 0; i < header.count; i++) {
+        if (reader->records[i].name >= header.strings_size ||
+                reader->records[i].link >= header.strings_size) {
+            fprintf(stderr, "Unsupported or damaged manifest %s\n", manifest);
+            munmap(reader->map, reader->map_size);
             return 1;
         }
+    }
+    return 0;
+}
 
-        char blob_dir[PATH_MAX];
-        char *output_dir = argv[4];
-        get_full_path(blob_dir, argv[3]);
-    
-        printf("%s\n" , output_dir);
-        chdir(output_dir);
-        
-        char line[PATH_MAX];
-        while (fgets(line, PATH_MAX, input_manifest)) {
-            //printf("%s", line);
-            
-            char type[4];
-            char mode[8];
-            char uid[32];
-            char gid[32];
-            char filename[PATH_MAX];
-            
-            char *token = line;
-            token = tokenize(type, token, '\t');
-            token = tokenize(mode, token, '\t');
-            token = tokenize(uid, token, '\t');
-            token = tokenize(gid, token, '\t');
-            token = tokenize(filename, token, '\t');
-            
-            int mode_oct = dec_to_oct(atoi(mode));
-            int uid_int = atoi(uid);
-            int gid_int = atoi(gid);
-            int ret;
-            printf("%s\t%s\t%s\t%s\t%s\t", type, mode, uid, gid, filename);
-            if (strcmp(type, "f") == 0) {
-                char sha256[128];
-                token = tokenize(sha256, token, '\t');
-                char sizeStr[32];
-                token = tokenize(sizeStr, token, '\t');
-                int size = atoi(sizeStr);
-                printf("%s\t%d\n", sha256, size);
-                
-                char blob_file[PATH_MAX];
-                sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(filename, blob_file)) {
-                    fprintf(stderr, "Unable to copy file %s\n", filename);
-                    fclose(input_manifest);
-                    return ret;
-                }
-                
-                chmod(filename, mode_oct);
-                chown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "l") == 0) {
-                char link[41];
-                token = tokenize(link, token, '\t');
-                printf("%s\n", link);
-                
-                symlink(link, filename);
-
-                // Android has no lchmod, and chmod follows symlinks
-                //chmod(filename, mode_oct);
-                lchown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "d") == 0) {
-                printf("\n");
+static void manifest_close(struct MANIFEST_READER *reader) {
+    if (reader->text != NULL)
+        fclose(reader->text);
+    if (reader->map != NULL)
+        munmap(reader->map, reader->map_size);
+}
 
-                mkdir(filename, mode_oct);
+// Index of the first record whose name is not below name.
+static uint32_t manifest_lower_bound(struct MANIFEST_READER *reader, const char *name) {
+    uint32_t lo = 0;
+    uint32_t hi = reader->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(reader->strings + reader->records[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-                chmod(filename, mode_oct);
-                chown(filename, uid_int, gid_int);
-            }
-            else {
-                fprintf(stderr, "Unknown type %s\n", type);
-                fclose(input_manifest);
-                return 1;
+// Entry names begin with "./"; path may leave it out.
+static void get_entry_name(const char *path, char *name) {
+    if (strncmp(path, "./", 2) == 0)
+        snprintf(name, PATH_MAX, "%s", path);
+    else
+        snprintf(name, PATH_MAX, "./%s", path);
+    int len = strlen(name);
+    while (len > 2 && name[len - 1] == '/')
+        name[--len] = '\0';
+}
+
+static int is_in_subtree(const char *name, const char *subtree) {
+    int len = strlen(subtree);
+    return strncmp(name, subtree, len) == 0 && (name[len] == '\0' || name[len] == '/');
+}
+
+// Only read the entry named subtree and everything below it.  A binary
+// manifest goes straight to them.
+static void manifest_select(struct MANIFEST_READER *reader, const char *subtree) {
+    reader->subtree = subtree;
+    if (reader->text != NULL)
+        return;
+    char key[PATH_MAX + 1];
+    uint32_t exact = manifest_lower_bound(reader, subtree);
+    if (exact < reader->count && strcmp(reader->strings + reader->records[exact].name, subtree) == 0)
+        reader->exact = exact;
+    // everything below subtree sorts between "subtree/" and "subtree0"
+    snprintf(key, sizeof(key), "%s/", subtree);
+    reader->next = manifest_lower_bound(reader, key);
+    key[strlen(key) - 1] = '/' + 1;
+    reader->end = manifest_lower_bound(reader, key);
+}
+
+static int manifest_parse_line(char *line, struct DEDUPE_ENTRY *entry) {
+    char type[4];
+    char mode[8];
+    char uid[32];
+    char gid[32];
+    char size[32];
+
+    char *token = line;
+    token = tokenize(type, token, '\t');
+    if (token != NULL)
+        token = tokenize(mode, token, '\t');
+    if (token != NULL)
+        token = tokenize(uid, token, '\t');
+    if (token != NULL)
+        token = tokenize(gid, token, '\t');
+    if (token != NULL)
+        token = tokenize(entry->name, token, '\t');
+    if (token == NULL)
+        return -1;
+
+    memset(&entry->st, 0, sizeof(entry->st));
+    entry->type = type[0];
+    entry->st.st_mode = dec_to_oct(atoi(mode));
+    entry->st.st_uid = atoi(uid);
+    entry->st.st_gid = atoi(gid);
+    entry->data[0] = '\0';
+    if (strcmp(type, "f") == 0 || strcmp(type, "c") == 0) {
+        token = tokenize(entry->data, token, '\t');
+        if (token != NULL)
+            token = tokenize(size, token, '\t');
+        if (token == NULL)
+            return -1;
+        entry->st.st_size = atoll(size);
+    }
+    else if (strcmp(type, "l") == 0) {
+        if (tokenize(entry->data, token, '\t') == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+// Returns 1 with the next entry, 0 at the end and -1 on a malformed
+// manifest.
+static int manifest_next(struct MANIFEST_READER *reader, struct DEDUPE_ENTRY *entry) {
+    if (reader->text != NULL) {
+        char line[PATH_MAX * 2];
+        do {
+            if (fgets(line, sizeof(line), reader->text) == NULL)
+                return 0;
+            if (manifest_parse_line(line, entry)) {
+                fprintf(stderr, "Malformed manifest line\n");
+                return -1;
             }
+        } while (reader->subtree != NULL && !is_in_subtree(entry->name, reader->subtree));
+        return 1;
+    }
+
+    const struct DEDUPE_RECORD *record;
+    if (reader->exact >= 0) {
+        record = &reader->records[reader->exact];
+        reader->exact = -1;
+    }
+    else if (reader->next < reader->end) {
+        record = &reader->records[reader->next++];
+    }
+    else {
+        return 0;
+    }
+    memset(&entry->st, 0, sizeof(entry->st));
+    entry->type = record->type;
+    entry->st.st_mode = record->mode;
+    entry->st.st_uid = record->uid;
+    entry->st.st_gid = record->gid;
+    entry->st.st_size = record->size;
+    snprintf(entry->name, sizeof(entry->name), "%s", reader->strings + record->name);
+    if (record->type == 'f' || record->type == 'c')
+        sha256_to_string(record->digest, entry->data);
+    else
+        snprintf(entry->data, sizeof(entry->data), "%s", reader->strings + record->link);
+    return 1;
+}
+
+// Collects the records of a binary manifest, which can only be written
+// once every entry is known.
+struct MANIFEST_WRITER {
+    struct DEDUPE_RECORD *records;
+    int count;
+    int capacity;
+    char *strings;
+    uint32_t strings_len;
+    uint32_t strings_size;
+};
+
+static int manifest_add_string(struct MANIFEST_WRITER *writer, const char *s, uint32_t *offset) {
+    uint32_t len = strlen(s) + 1;
+    if (writer->strings_len + len > writer->strings_size) {
+        uint32_t size = writer->strings_size == 0 ? 65536 : writer->strings_size;
+        while (writer->strings_len + len > size)
+            size *= 2;
+        char *grown = realloc(writer->strings, size);
+        if (grown == NULL)
+            return 1;
+        writer->strings = grown;
+        writer->strings_size = size;
+    }
+    *offset = writer->strings_len;
+    memcpy(writer->strings + writer->strings_len, s, len);
+    writer->strings_len += len;
+    return 0;
+}
+
+static int manifest_add(struct MANIFEST_WRITER *writer, const struct DEDUPE_ENTRY *entry) {
+    if (writer->count == writer->capacity) {
+        int capacity = writer->capacity == 0 ? 1024 : writer->capacity * 2;
+        struct DEDUPE_RECORD *grown = realloc(writer->records, capacity * sizeof(struct DEDUPE_RECORD));
+        if (grown == NULL)
+            return 1;
+        writer->records = grown;
+        writer->capacity = capacity;
+    }
+    // offset 0 is the empty string, for entries without a link target
+    uint32_t empty;
+    if (writer->strings_len == 0 && manifest_add_string(writer, "", &empty))
+        return 1;
+
+    struct DEDUPE_RECORD *record = &writer->records[writer->count];
+    memset(record, 0, sizeof(*record));
+    record->type = entry->type;
+    record->mode = entry->st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID);
+    record->uid = entry->st.st_uid;
+    record->gid = entry->st.st_gid;
+    if (manifest_add_string(writer, entry->name, &record->name))
+        return 1;
+    if (entry->type == 'f' || entry->type == 'c') {
+        record->size = entry->st.st_size;
+        if (string_to_sha256(entry->data, record->digest))
+            return 1;
+    }
+    else if (entry->type == 'l' && manifest_add_string(writer, entry->data, &record->link)) {
+        return 1;
+    }
+    writer->count++;
+    return 0;
+}
+
+struct MANIFEST_SORT_KEY {
+    const char *name;
+    int index;
+};
+
+static int compare_sort_keys(const void *a, const void *b) {
+    return strcmp(((const struct MANIFEST_SORT_KEY *)a)->name,
+            ((const struct MANIFEST_SORT_KEY *)b)->name);
+}
+
+static int manifest_write(struct MANIFEST_WRITER *writer, FILE *out) {
+    struct MANIFEST_SORT_KEY *keys = malloc((writer->count + 1) * sizeof(struct MANIFEST_SORT_KEY));
+    if (keys == NULL)
+        return 1;
+    int i;
+    for (i = 0; i < writer->count; i++) {
+        keys[i].name = writer->strings + writer->records[i].name;
+        keys[i].index = i;
+    }
+    qsort(keys, writer->count, sizeof(struct MANIFEST_SORT_KEY), compare_sort_keys);
+
+    uint32_t empty;
+    if (writer->strings_len == 0 && manifest_add_string(writer, "", &empty)) {
+        free(keys);
+        return 1;
+    }
+    struct DEDUPE_MANIFEST_HEADER header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DEDUPE_MANIFEST_MAGIC;
+    header.version = DEDUPE_MANIFEST_VERSION;
+    header.count = writer->count;
+    header.record_size = sizeof(struct DEDUPE_RECORD);
+    header.strings_offset = sizeof(header) + (uint64_t)writer->count * sizeof(struct DEDUPE_RECORD);
+    header.strings_size = writer->strings_len;
+    int ret = fwrite(&header, sizeof(header), 1, out) != 1;
+    for (i = 0; ret == 0 && i < writer->count; i++)
+        ret = fwrite(&writer->records[keys[i].index], sizeof(struct DEDUPE_RECORD), 1, out) != 1;
+    if (ret == 0)
+        ret = fwrite(writer->strings, writer->strings_len, 1, out) != 1;
+    free(keys);
+    return ret;
+}
+
+static void manifest_writer_free(struct MANIFEST_WRITER *writer) {
+    free(writer->records);
+    free(writer->strings);
+    memset(writer, 0, sizeof(*writer));
+}
+
+static void print_entry(FILE *out, const struct DEDUPE_ENTRY *entry) {
+    fprintf(out, "%c\t%o\t%d\t%d\t%s\t", entry->type,
+            (unsigned int)(entry->st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID)),
+            (int)entry->st.st_uid, (int)entry->st.st_gid, entry->name);
+    if (entry->type == 'f' || entry->type == 'c')
+        fprintf(out, "%s\t%lld\t\n", entry->data, (long long)entry->st.st_size);
+    else if (entry->type == 'l')
+        fprintf(out, "%s\t\n", entry->data);
+    else
+        fprintf(out, "\n");
+}
+
+/*
+ * Files are hashed, stored and restored on a pool of worker threads.
+ * Jobs are handed out in manifest order through a ring, and finished
+ * (written to the manifest, reported) in that same order on the
+ * calling thread, so the output is identical whatever the thread
+ * count.
+ */
+
+enum { JOB_FREE, JOB_QUEUED, JOB_DONE };
+
+struct DEDUPE_JOB {
+    int state;
+    int ret;
+    struct DEDUPE_ENTRY entry;
+};
+
+typedef int (*dedupe_work_function)(void *context, struct DEDUPE_JOB *job, char *buf);
+typedef int (*dedupe_finish_function)(void *context, struct DEDUPE_JOB *job);
+
+struct DEDUPE_WORKER {
+    struct DEDUPE_POOL *pool;
+    pthread_t thread;
+    char *buf;                  // DEDUPE_BUFFER_SIZE
+};
+
+struct DEDUPE_POOL {
+    struct DEDUPE_JOB *jobs;
+    int num_jobs;
+    long next_queue;            // next job to be filled in
+    long next_work;             // next job a worker picks up
+    long next_done;             // oldest job not yet finished
+    struct DEDUPE_WORKER workers[DEDUPE_MAX_THREADS];
+    int num_threads;
+    int shutdown;
+    int ret;                    // first error
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    dedupe_work_function work;
+    dedupe_finish_function finish;
+    void *context;
+};
+
+static void *pool_worker(void *cookie) {
+    struct DEDUPE_WORKER *worker = (struct DEDUPE_WORKER *)cookie;
+    struct DEDUPE_POOL *pool = worker->pool;
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->shutdown && pool->next_work == pool->next_queue)
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        if (pool->next_work == pool->next_queue)
+            break;
+        struct DEDUPE_JOB *job = &pool->jobs[pool->next_work % pool->num_jobs];
+        pool->next_work++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        int ret = pool->work(pool->context, job, worker->buf);
+
+        pthread_mutex_lock(&pool->mutex);
+        job->ret = ret;
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static void pool_stop(struct DEDUPE_POOL *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    int i;
+    for (i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        free(pool->workers[i].buf);
+    }
+    free(pool->jobs);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+}
+
+// threads <= 0 uses every core.
+static int pool_start(struct DEDUPE_POOL *pool, int threads,
+        dedupe_work_function work, dedupe_finish_function finish, void *context) {
+    memset(pool, 0, sizeof(*pool));
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    if (threads > DEDUPE_MAX_THREADS)
+        threads = DEDUPE_MAX_THREADS;
+    pool->work = work;
+    pool->finish = finish;
+    pool->context = context;
+    // enough jobs in flight to keep every worker busy while the
+    // calling thread walks the tree
+    pool->num_jobs = 4 * threads;
+    pool->jobs = calloc(pool->num_jobs, sizeof(struct DEDUPE_JOB));
+    if (pool->jobs == NULL)
+        return 1;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    int i;
+    for (i = 0; i < threads; i++) {
+        struct DEDUPE_WORKER *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->buf = malloc(DEDUPE_BUFFER_SIZE);
+        if (worker->buf == NULL)
+            break;
+        if (pthread_create(&worker->thread, NULL, pool_worker, worker) != 0) {
+            free(worker->buf);
+            break;
         }
-        
-        fclose(input_manifest);
+        pool->num_threads++;
+    }
+    if (pool->num_threads == 0) {
+        pool_stop(pool);
+        return 1;
+    }
+    return 0;
+}
+
+// Wait for the oldest job and finish it.
+static void pool_finish_oldest(struct DEDUPE_POOL *pool) {
+    struct DEDUPE_JOB *job = &pool->jobs[pool->next_done % pool->num_jobs];
+    pthread_mutex_lock(&pool->mutex);
+    while (job->state != JOB_DONE)
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+
+    // after an error only drain what is left
+    if (pool->ret == 0 && (pool->ret = job->ret) == 0)
+        pool->ret = pool->finish(pool->context, job);
+
+    pthread_mutex_lock(&pool->mutex);
+    job->state = JOB_FREE;
+    pool->next_done++;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Returns the next job to fill in, or NULL once something has failed.
+static struct DEDUPE_JOB *pool_next_job(struct DEDUPE_POOL *pool) {
+    struct DEDUPE_JOB *job = &pool->jobs[pool->next_queue % pool->num_jobs];
+    while (pool->ret == 0 && job->state != JOB_FREE)
+        pool_finish_oldest(pool);
+    if (pool->ret != 0)
+        return NULL;
+    memset(job, 0, sizeof(*job));
+    return job;
+}
+
+static void pool_queue(struct DEDUPE_POOL *pool, struct DEDUPE_JOB *job) {
+    pthread_mutex_lock(&pool->mutex);
+    job->state = JOB_QUEUED;
+    pool->next_queue++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Finish every outstanding job and stop the workers.  Returns the
+// first error.
+static int pool_finish(struct DEDUPE_POOL *pool) {
+    while (pool->next_done < pool->next_queue)
+        pool_finish_oldest(pool);
+    int ret = pool->ret;
+    pool_stop(pool);
+    return ret;
+}
+
+static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
+
+static void report(struct DEDUPE_STORE_CONTEXT *context, const char *f) {
+    if (context->callback != NULL)
+        context->callback(f, context->bytes, context->cookie);
+    else
+        printf("%s\n", f);
+}
+
+// Temporary blobs never have a valid digest as their name, so a blob
+// name is only ever seen with its complete contents.
+static int open_temp_blob(struct DEDUPE_STORE_CONTEXT *context, char *tmp) {
+    snprintf(tmp, PATH_MAX, "%s/.blob-XXXXXX", context->blob_dir);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        fprintf(stderr, "Unable to create temporary blob in %s\n", context->blob_dir);
+    return fd;
+}
+
+static int is_known_blob(struct DEDUPE_STORE_CONTEXT *context, const unsigned char *sumdata) {
+    pthread_mutex_lock(&context->mutex);
+    int known = known_blobs_contains(&context->known, sumdata);
+    if (known)
+        context->blobs_reused++;
+    pthread_mutex_unlock(&context->mutex);
+    return known;
+}
+
+// Give a complete temporary blob its final name.
+static int publish_blob(struct DEDUPE_STORE_CONTEXT *context, const char *tmp,
+        const unsigned char *sumdata, const char *psum, int compressed) {
+    // Two workers may store the same new blob at once; whichever
+    // rename comes last replaces an identical file.
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s%s", psum, compressed ? DEDUPE_COMPRESSED_SUFFIX : "");
+    if (move_blob(tmp, context->blob_dir, name)) {
+        unlink(tmp);
+        return 5;
+    }
+
+    pthread_mutex_lock(&context->mutex);
+    context->blobs_written++;
+    int ret = known_blobs_add(&context->known, sumdata);
+    pthread_mutex_unlock(&context->mutex);
+    return ret;
+}
+
+// Inflating costs time at every restore, so a blob is only kept
+// compressed if that saves a sixteenth of it.
+static int is_worth_compressing(uint64_t compressed_len, uint64_t len) {
+    return compressed_len < len - len / 16;
+}
+
+// Add len bytes of data to the store unless they are there already.
+static int store_buffer(struct DEDUPE_STORE_CONTEXT *context, const char *data, int len,
+        char *psum) {
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *)data, len, sumdata);
+    sha256_to_string(sumdata, psum);
+    // The store is shared by every backup, so most blobs are there
+    // already from an earlier one.
+    if (is_known_blob(context, sumdata))
         return 0;
+
+    char *zdata = NULL;
+    int compressed = 0;
+    if (context->flags & DEDUPE_COMPRESS) {
+        uLongf zlen = compressBound(len);
+        zdata = malloc(zlen);
+        if (zdata != NULL &&
+                compress2((Bytef *)zdata, &zlen, (const Bytef *)data, len, DEDUPE_COMPRESS_LEVEL) == Z_OK &&
+                is_worth_compressing(zlen, len)) {
+            data = zdata;
+            len = zlen;
+            compressed = 1;
+        }
+    }
+
+    char tmp[PATH_MAX];
+    int fd = open_temp_blob(context, tmp);
+    int ret = fd < 0 || write_fully(fd, data, len);
+    free(zdata);
+    if (fd >= 0 && (close(fd) || ret)) {
+        unlink(tmp);
+        ret = 1;
+    }
+    if (ret)
+        return 5;
+    return publish_blob(context, tmp, sumdata, psum, compressed);
+}
+
+// Feed len bytes of data to z and write out what it produces.  out
+// holds DEDUPE_ZBUF_SIZE bytes.
+static int deflate_to(int fd, z_stream *z, const char *data, int len, int flush, char *out) {
+    z->next_in = (Bytef *)data;
+    z->avail_in = len;
+    do {
+        z->next_out = (Bytef *)out;
+        z->avail_out = DEDUPE_ZBUF_SIZE;
+        if (deflate(z, flush) == Z_STREAM_ERROR)
+            return 1;
+        if (write_fully(fd, out, DEDUPE_ZBUF_SIZE - z->avail_out))
+            return 1;
+    } while (z->avail_out == 0);
+    return 0;
+}
+
+// Read the file once, hashing it, and add its contents to the store
+// unless they are there already.  buf holds DEDUPE_BUFFER_SIZE bytes.
+static int store_blob(struct DEDUPE_STORE_CONTEXT *context, const char *full_path,
+        char *psum, char *buf) {
+    int fd = open(full_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file: %s\n", full_path);
+        return 3;
+    }
+
+    int len = read_fully(fd, buf, DEDUPE_BUFFER_SIZE);
+    if (len >= 0 && len < DEDUPE_BUFFER_SIZE) {
+        close(fd);
+        return store_buffer(context, buf, len, psum);
+    }
+
+    // Too big to keep in memory until the digest is known.  Whether
+    // compression pays is judged by the first buffer.
+    SHA256_CTX c;
+    SHA256_Init(&c);
+    char tmp[PATH_MAX];
+    int tmpfd = -1;
+    int ret = 0;
+    z_stream z;
+    char *zbuf = NULL;
+    int compressed = 0;
+    memset(&z, 0, sizeof(z));
+    if (len < 0 || (tmpfd = open_temp_blob(context, tmp)) < 0)
+        ret = 5;
+    else
+        SHA256_Update(&c, buf, len);
+    int written = 0;
+    if (ret == 0 && (context->flags & DEDUPE_COMPRESS) &&
+            (zbuf = malloc(DEDUPE_ZBUF_SIZE)) != NULL &&
+            deflateInit(&z, DEDUPE_COMPRESS_LEVEL) == Z_OK) {
+        compressed = 1;
+        written = 1;
+        if (deflate_to(tmpfd, &z, buf, len, Z_SYNC_FLUSH, zbuf))
+            ret = 5;
+        else if (!is_worth_compressing(z.total_out, len))
+            compressed = 0;
+        if (!compressed) {
+            deflateEnd(&z);
+            written = 0;
+            if (ftruncate(tmpfd, 0) || lseek(tmpfd, 0, SEEK_SET) != 0)
+                ret = 5;
+        }
+    }
+    while (ret == 0 && len > 0) {
+        if (!written) {
+            if (compressed)
+                ret = deflate_to(tmpfd, &z, buf, len, Z_NO_FLUSH, zbuf) ? 5 : 0;
+            else
+                ret = write_fully(tmpfd, buf, len) ? 5 : 0;
+        }
+        written = 0;
+        if (ret == 0 && (len = read_fully(fd, buf, DEDUPE_BUFFER_SIZE)) > 0)
+            SHA256_Update(&c, buf, len);
+    }
+    if (compressed) {
+        if (ret == 0 && deflate_to(tmpfd, &z, NULL, 0, Z_FINISH, zbuf))
+            ret = 5;
+        deflateEnd(&z);
+    }
+    free(zbuf);
+    if (len < 0) {
+        fprintf(stderr, "Error reading %s\n", full_path);
+        ret = 5;
+    }
+    close(fd);
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    SHA256_Final(sumdata, &c);
+    sha256_to_string(sumdata, psum);
+
+    if (tmpfd >= 0 && close(tmpfd) && ret == 0)
+        ret = 5;
+    if (ret != 0 || is_known_blob(context, sumdata)) {
+        if (tmpfd >= 0)
+            unlink(tmp);
+        return ret;
+    }
+    return publish_blob(context, tmp, sumdata, psum, compressed);
+}
+
+/*
+ * Content defined chunking.  A gear hash is rolled over the data and a
+ * chunk ends where its top bits are all zero, so boundaries depend only
+ * on the last few dozen bytes and an insert or a rewritten page only
+ * changes the chunks around it.  The gear table must never change, or
+ * the chunks of a new backup no longer line up with the stored ones.
+ */
+static uint32_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init(void) {
+    uint32_t x = 0x9e3779b9;
+    int i;
+    for (i = 0; i < 256; i++) {
+        // xorshift32
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        gear[i] = x;
+    }
+}
+
+// Returns the length of the chunk at the start of data, which holds
+// len bytes and ends the file unless len >= DEDUPE_CHUNK_MAX.
+static int next_chunk(const unsigned char *data, int len) {
+    if (len <= DEDUPE_CHUNK_MIN)
+        return len;
+    if (len > DEDUPE_CHUNK_MAX)
+        len = DEDUPE_CHUNK_MAX;
+    uint32_t hash = 0;
+    int i;
+    for (i = DEDUPE_CHUNK_MIN - 64; i < DEDUPE_CHUNK_MIN; i++)
+        hash = (hash << 1) + gear[data[i]];
+    for (; i < len; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & DEDUPE_CHUNK_MASK) == 0)
+            return i + 1;
+    }
+    return len;
+}
+
+// Store the file as chunks, and their list as one more blob, whose
+// digest goes in psum.  The list has a "<digest>\t<length>\n" line for
+// every chunk.  buf holds DEDUPE_BUFFER_SIZE bytes.
+static int store_chunks(struct DEDUPE_STORE_CONTEXT *context, const char *full_path,
+        char *psum, char *buf) {
+    int fd = open(full_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file: %s\n", full_path);
+        return 3;
+    }
+    pthread_once(&gear_once, gear_init);
+
+    char *list = NULL;
+    int list_len = 0;
+    int list_size = 0;
+    int have = 0;               // bytes in buf
+    int pos = 0;                // start of the next chunk
+    int eof = 0;
+    int ret = 0;
+    while (ret == 0) {
+        if (!eof && have - pos < DEDUPE_CHUNK_MAX) {
+            memmove(buf, buf + pos, have - pos);
+            have -= pos;
+            pos = 0;
+            int len = read_fully(fd, buf + have, DEDUPE_BUFFER_SIZE - have);
+            if (len < 0) {
+                fprintf(stderr, "Error reading %s\n", full_path);
+                ret = 5;
+                break;
+            }
+            eof = have + len < DEDUPE_BUFFER_SIZE;
+            have += len;
+        }
+        if (pos == have)
+            break;
+
+        int len = next_chunk((unsigned char *)buf + pos, have - pos);
+        char chunk_sum[128];
+        if ((ret = store_buffer(context, buf + pos, len, chunk_sum)) != 0)
+            break;
+        pos += len;
+
+        if (list_size - list_len < 128) {
+            list_size = list_size == 0 ? 4096 : list_size * 2;
+            char *grown = realloc(list, list_size);
+            if (grown == NULL) {
+                ret = 1;
+                break;
+            }
+            list = grown;
+        }
+        list_len += sprintf(list + list_len, "%s\t%d\n", chunk_sum, len);
+    }
+    close(fd);
+
+    if (ret == 0)
+        ret = store_buffer(context, list == NULL ? "" : list, list_len, psum);
+    free(list);
+    return ret;
+}
+
+// Runs on a worker thread.
+static int store_work(void *cookie, struct DEDUPE_JOB *job, char *buf) {
+    struct DEDUPE_STORE_CONTEXT *context = (struct DEDUPE_STORE_CONTEXT *)cookie;
+    char full_path[PATH_MAX];
+    get_input_path(context, full_path, job->entry.name);
+    int ret;
+    if (job->entry.type == 'f')
+        ret = store_blob(context, full_path, job->entry.data, buf);
+    else if (job->entry.type == 'c')
+        ret = store_chunks(context, full_path, job->entry.data, buf);
+    else
+        return 0;
+    if (ret)
+        fprintf(stderr, "Error storing blob of %s\n", job->entry.name);
+    return ret;
+}
+
+// Runs on the calling thread, in tree order.
+static int store_finish(void *cookie, struct DEDUPE_JOB *job) {
+    struct DEDUPE_STORE_CONTEXT *context = (struct DEDUPE_STORE_CONTEXT *)cookie;
+    if (job->entry.type == 'f' || job->entry.type == 'c')
+        context->bytes += job->entry.st.st_size;
+    if (context->writer != NULL) {
+        if (manifest_add(context->writer, &job->entry))
+            return 1;
+    }
+    else {
+        print_entry(context->output_manifest, &job->entry);
+    }
+    report(context, job->entry.name);
+    return 0;
+}
+
+static int queue_entry(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, const char *s,
+        const char *data) {
+    struct DEDUPE_JOB *job = pool_next_job(context->pool);
+    if (job == NULL)
+        return context->pool->ret;
+    job->entry.type = type;
+    job->entry.st = st;
+    strcpy(job->entry.name, s);
+    if (data != NULL)
+        strcpy(job->entry.data, data);
+    pool_queue(context->pool, job);
+    return 0;
+}
+
+static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
+    char full_path[PATH_MAX];
+    get_input_path(context, full_path, d);
+    DIR *dp = opendir(full_path);
+    if (dp == NULL) {
+        fprintf(stderr, "Error opening directory: %s\n", d);
+        return 1;
+    }
+    struct dirent *ep;
+    char rel_path[PATH_MAX];
+    while (ep = readdir(dp)) {
+        if (strcmp(ep->d_name, ".") == 0)
+            continue;
+        if (strcmp(ep->d_name, "..") == 0)
+            continue;
+        struct stat cst;
+        int ret;
+        snprintf(rel_path, sizeof(rel_path), "%s/%s", d, ep->d_name);
+        if (is_excluded(context, rel_path))
+            continue;
+        get_input_path(context, full_path, rel_path);
+        if (0 != (ret = lstat(full_path, &cst))) {
+            fprintf(stderr, "Error opening: %s\n", ep->d_name);
+            closedir(dp);
+            return ret;
+        }
+
+        if (ret = store_st(context, cst, rel_path)) {
+            closedir(dp);
+            return ret;
+        }
+    }
+    closedir(dp);
+    return 0;
+}
+
+static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
+    int ret;
+    if (S_ISREG(st.st_mode)) {
+        // small files would only be split into a chunk or two
+        if ((context->flags & DEDUPE_CHUNK) && st.st_size >= DEDUPE_CHUNK_FILE_MIN)
+            return queue_entry(context, 'c', st, s, NULL);
+        // Staging a file too big to hash in memory would rewrite it to
+        // the card even when its blob is known.  The chunker reads it
+        // once and only writes chunks that are new.
+        if (st.st_size >= DEDUPE_BUFFER_SIZE)
+            return queue_entry(context, 'c', st, s, NULL);
+        return queue_entry(context, 'f', st, s, NULL);
+    }
+    else if (S_ISDIR(st.st_mode)) {
+        if (ret = queue_entry(context, 'd', st, s, NULL))
+            return ret;
+        return store_dir(context, st, s);
+    }
+    else if (S_ISLNK(st.st_mode)) {
+        char full_path[PATH_MAX];
+        get_input_path(context, full_path, s);
+        char link[PATH_MAX];
+        int len = readlink(full_path, link, PATH_MAX - 1);
+        if (len < 0) {
+            fprintf(stderr, "Error reading symlink\n");
+            return errno;
+        }
+        link[len] = '\0';
+        return queue_entry(context, 'l', st, s, link);
+    }
+    else {
+        fprintf(stderr, "Skipping special: %s\n", s);
+        return 0;
+    }
+}
+
+// Invoked with the contents of a blob, in order, as it is read.
+typedef int (*blob_sink)(void *cookie, const char *data, int len);
+
+// Read the blob open at fd, inflating it if it is compressed, and
+// check its contents against the name it is stored under on the way.
+// sink may be NULL.  buf holds DEDUPE_BUFFER_SIZE bytes.  Closes fd.
+static int read_blob_fd(int fd, int compressed, const char *sha256, char *buf,
+        blob_sink sink, void *cookie) {
+    // compressed data goes through the first half of buf
+    char *out = buf + DEDUPE_BUFFER_SIZE / 2;
+    int in_size = compressed ? DEDUPE_BUFFER_SIZE / 2 : DEDUPE_BUFFER_SIZE;
+    z_stream z;
+    int zret = Z_OK;
+    memset(&z, 0, sizeof(z));
+    if (compressed && inflateInit(&z) != Z_OK) {
+        close(fd);
+        return 5;
+    }
+
+    SHA256_CTX c;
+    SHA256_Init(&c);
+    int ret = 0;
+    int bytes_read;
+    while (ret == 0 && zret != Z_STREAM_END && (bytes_read = read(fd, buf, in_size)) > 0) {
+        if (!compressed) {
+            SHA256_Update(&c, buf, bytes_read);
+            if (sink != NULL)
+                ret = sink(cookie, buf, bytes_read);
+            continue;
+        }
+        z.next_in = (Bytef *)buf;
+        z.avail_in = bytes_read;
+        do {
+            z.next_out = (Bytef *)out;
+            z.avail_out = DEDUPE_BUFFER_SIZE / 2;
+            zret = inflate(&z, Z_NO_FLUSH);
+            if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+                ret = 6;
+                break;
+            }
+            int len = DEDUPE_BUFFER_SIZE / 2 - z.avail_out;
+            SHA256_Update(&c, out, len);
+            if (sink != NULL && len > 0)
+                ret = sink(cookie, out, len);
+        } while (ret == 0 && zret != Z_STREAM_END && z.avail_out == 0);
+    }
+    if (bytes_read < 0 && ret == 0)
+        ret = 5;
+    if (compressed) {
+        if (zret != Z_STREAM_END && ret == 0)
+            ret = 6;
+        inflateEnd(&z);
+    }
+    close(fd);
+
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    char psum[128];
+    SHA256_Final(sumdata, &c);
+    sha256_to_string(sumdata, psum);
+    if (ret == 6 || (ret == 0 && strcmp(psum, sha256) != 0)) {
+        fprintf(stderr, "Blob %s is corrupt\n", sha256);
+        return 6;
+    }
+    return ret;
+}
+
+static int read_blob(const char *blob_dir, const char *sha256, char *buf,
+        blob_sink sink, void *cookie) {
+    int compressed;
+    int fd = open_blob(blob_dir, sha256, &compressed);
+    if (fd < 0)
+        return 3;
+    return read_blob_fd(fd, compressed, sha256, buf, sink, cookie);
+}
+
+static int write_sink(void *cookie, const char *data, int len) {
+    return write_fully(*(int *)cookie, data, len) ? 5 : 0;
+}
+
+struct MEMORY_SINK {
+    char *data;
+    int len;
+    int size;
+};
+
+static int memory_sink(void *cookie, const char *data, int len) {
+    struct MEMORY_SINK *m = (struct MEMORY_SINK *)cookie;
+    // room for a terminating NUL
+    if (m->len + len + 1 > m->size) {
+        int size = m->size == 0 ? 4096 : m->size;
+        while (m->len + len + 1 > size)
+            size *= 2;
+        char *grown = realloc(m->data, size);
+        if (grown == NULL)
+            return 1;
+        m->data = grown;
+        m->size = size;
+    }
+    memcpy(m->data + m->len, data, len);
+    m->len += len;
+    return 0;
+}
+
+// Append a blob from the store to dstfd.  buf holds DEDUPE_BUFFER_SIZE
+// bytes.
+static int copy_blob(int dstfd, const char *blob_dir, const char *sha256, char *buf) {
+    return read_blob(blob_dir, sha256, buf, write_sink, &dstfd);
+}
+
+// Read the chunk list of a chunked file into a new NUL terminated
+// buffer.  Returns NULL if it is missing or corrupt.
+static char *read_chunk_list(const char *blob_dir, const char *sha256) {
+    char *buf = malloc(DEDUPE_BUFFER_SIZE);
+    if (buf == NULL)
+        return NULL;
+    struct MEMORY_SINK m;
+    memset(&m, 0, sizeof(m));
+    int ret = read_blob(blob_dir, sha256, buf, memory_sink, &m);
+    free(buf);
+    if (ret == 0 && m.data == NULL)
+        ret = memory_sink(&m, "", 0);
+    if (ret != 0) {
+        free(m.data);
+        return NULL;
+    }
+    m.data[m.len] = '\0';
+    return m.data;
+}
+
+// ext4 keeps a file contiguous when it knows the size up front.
+// Filesystems that can't preallocate just refuse, which is harmless.
+static void preallocate(int fd, uint64_t size) {
+    if (size == 0)
+        return;
+#if defined(__GLIBC__) || (defined(__ANDROID_API__) && __ANDROID_API__ >= 21)
+    fallocate(fd, 0, 0, size);
+#elif defined(__NR_fallocate) && defined(__arm__)
+    // older bionic has no wrapper; EABI passes each 64 bit argument in
+    // an aligned register pair
+    syscall(__NR_fallocate, fd, 0, 0, 0, (uint32_t)size, (uint32_t)(size >> 32));
+#endif
+}
+
+// Recreate a file from its blob, or for type 'c' from the chunks in
+// its chunk list, and give it the ownership and mode in st.
+static int extract_blob(const char *dst, const char *blob_dir, char type,
+        const char *sha256, const struct stat *st, char *buf) {
+    char *list = NULL;
+    if (type == 'c' && (list = read_chunk_list(blob_dir, sha256)) == NULL)
+        return 3;
+
+    int dstfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (dstfd < 0) {
+        free(list);
+        return 4;
+    }
+    preallocate(dstfd, st->st_size);
+
+    int ret = 0;
+    if (type == 'c') {
+        char *line = list;
+        char *end;
+        while (ret == 0 && (end = strchr(line, '\n')) != NULL) {
+            *end = '\0';
+            char *tab = strchr(line, '\t');
+            if (tab != NULL)
+                *tab = '\0';
+            ret = copy_blob(dstfd, blob_dir, line, buf);
+            line = end + 1;
+        }
+    }
+    else {
+        ret = copy_blob(dstfd, blob_dir, sha256, buf);
+    }
+
+    // chown clears the setuid and setgid bits, so it goes first
+    if (ret == 0) {
+        fchown(dstfd, st->st_uid, st->st_gid);
+        fchmod(dstfd, st->st_mode);
+    }
+    if (close(dstfd) && ret == 0)
+        ret = 5;
+    free(list);
+    return ret;
+}
+
+int dedupe_store(const char *input_directory, const char *blob_dir,
+        const char *manifest, const char **excludes, int flags, int threads,
+        dedupe_callback callback, void *cookie) {
+    struct stat st;
+    int ret;
+    if (0 != (ret = lstat(input_directory, &st))) {
+        fprintf(stderr, "Error opening input_file/input_directory.\n");
+        return ret;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s must be a directory.\n", input_directory);
+        return 1;
+    }
+
+    // waits for a gc to finish
+    int lock = lock_blob_dir(blob_dir, LOCK_SH);
+    if (lock < 0) {
+        fprintf(stderr, "Unable to lock blob directory %s\n", blob_dir);
+        return 1;
+    }
+    struct DEDUPE_STORE_CONTEXT context;
+    memset(&context, 0, sizeof(context));
+    if (known_blobs_load(&context.known, blob_dir)) {
+        fprintf(stderr, "Unable to read blob directory %s\n", blob_dir);
+        known_blobs_free(&context.known);
+        close(lock);
+        return 1;
+    }
+    context.output_manifest = fopen(manifest, "wb");
+    if (context.output_manifest == NULL) {
+        fprintf(stderr, "Unable to open output file %s\n", manifest);
+        known_blobs_free(&context.known);
+        close(lock);
+        return 1;
+    }
+    strncpy(context.blob_dir, blob_dir, sizeof(context.blob_dir) - 1);
+    context.input_directory = input_directory;
+    context.excludes = excludes;
+    context.flags = flags;
+    context.callback = callback;
+    context.cookie = cookie;
+    pthread_mutex_init(&context.mutex, NULL);
+    struct MANIFEST_WRITER writer;
+    memset(&writer, 0, sizeof(writer));
+    if (flags & DEDUPE_BINARY_MANIFEST)
+        context.writer = &writer;
+
+    struct DEDUPE_POOL pool;
+    context.pool = &pool;
+    if (pool_start(&pool, threads, store_work, store_finish, &context)) {
+        ret = 1;
+    } else {
+        ret = store_dir(&context, st, ".");
+        int pool_ret = pool_finish(&pool);
+        if (ret == 0)
+            ret = pool_ret;
+    }
+    if (ret == 0 && context.writer != NULL)
+        ret = manifest_write(context.writer, context.output_manifest);
+    manifest_writer_free(&writer);
+    if (fclose(context.output_manifest) && ret == 0) {
+        fprintf(stderr, "Unable to write output file %s\n", manifest);
+        ret = 1;
+    }
+    printf("%d new blobs, %d already stored\n", context.blobs_written, context.blobs_reused);
+    pthread_mutex_destroy(&context.mutex);
+    known_blobs_free(&context.known);
+    close(lock);
+    return ret;
+}
+
+// Directories are created writable and only get their real ownership
+// and mode once everything in them has been restored.
+struct DEFERRED_DIR {
+    char *path;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+};
+
+struct DEDUPE_EXTRACT_CONTEXT {
+    const char *blob_dir;
+    const char *output_directory;
+    dedupe_callback callback;
+    void *cookie;
+    uint64_t bytes;
+    struct DEFERRED_DIR *dirs;
+    int num_dirs;
+    int dirs_size;
+};
+
+static int create_dir(struct DEDUPE_EXTRACT_CONTEXT *context, const struct DEDUPE_ENTRY *entry) {
+    char output_file[PATH_MAX];
+    snprintf(output_file, sizeof(output_file), "%s/%s", context->output_directory, entry->name);
+    mkdir(output_file, 0700);
+
+    if (context->num_dirs == context->dirs_size) {
+        int size = context->dirs_size == 0 ? 256 : context->dirs_size * 2;
+        struct DEFERRED_DIR *grown = realloc(context->dirs, size * sizeof(struct DEFERRED_DIR));
+        if (grown == NULL)
+            return 1;
+        context->dirs = grown;
+        context->dirs_size = size;
+    }
+    struct DEFERRED_DIR *dir = &context->dirs[context->num_dirs];
+    if ((dir->path = strdup(output_file)) == NULL)
+        return 1;
+    dir->mode = entry->st.st_mode;
+    dir->uid = entry->st.st_uid;
+    dir->gid = entry->st.st_gid;
+    context->num_dirs++;
+    return 0;
+}
+
+// Apply the metadata of every directory, deepest first, so no
+// directory is locked down before what is below it.
+static void finish_dirs(struct DEDUPE_EXTRACT_CONTEXT *context) {
+    int i;
+    for (i = context->num_dirs - 1; i >= 0; i--) {
+        struct DEFERRED_DIR *dir = &context->dirs[i];
+        chown(dir->path, dir->uid, dir->gid);
+        chmod(dir->path, dir->mode);
+        free(dir->path);
+    }
+    free(context->dirs);
+    context->dirs = NULL;
+    context->num_dirs = 0;
+}
+
+// Runs on a worker thread.  Directories are created up front, in
+// manifest order, so everything below them can be restored in any
+// order.
+static int extract_work(void *cookie, struct DEDUPE_JOB *job, char *buf) {
+    struct DEDUPE_EXTRACT_CONTEXT *context = (struct DEDUPE_EXTRACT_CONTEXT *)cookie;
+    char output_file[PATH_MAX];
+    snprintf(output_file, sizeof(output_file), "%s/%s", context->output_directory, job->entry.name);
+    int ret;
+    if (job->entry.type == 'f' || job->entry.type == 'c') {
+        if (ret = extract_blob(output_file, context->blob_dir, job->entry.type, job->entry.data,
+                &job->entry.st, buf)) {
+            fprintf(stderr, "Unable to copy file %s\n", job->entry.name);
+            return ret;
+        }
+    }
+    else if (job->entry.type == 'l') {
+        symlink(job->entry.data, output_file);
+
+        // Android has no lchmod, and chmod follows symlinks
+        //chmod(filename, mode_oct);
+        lchown(output_file, job->entry.st.st_uid, job->entry.st.st_gid);
+    }
+    return 0;
+}
+
+// Runs on the calling thread, in manifest order.
+static int extract_finish(void *cookie, struct DEDUPE_JOB *job) {
+    struct DEDUPE_EXTRACT_CONTEXT *context = (struct DEDUPE_EXTRACT_CONTEXT *)cookie;
+    if (job->entry.type == 'f' || job->entry.type == 'c')
+        context->bytes += job->entry.st.st_size;
+    if (context->callback != NULL) {
+        context->callback(job->entry.name, context->bytes, context->cookie);
+        return 0;
+    }
+    printf("%c\t%o\t%d\t%d\t%s\t", job->entry.type, job->entry.st.st_mode, job->entry.st.st_uid, job->entry.st.st_gid, job->entry.name);
+    if (job->entry.type == 'f' || job->entry.type == 'c')
+        printf("%s\t%lld\n", job->entry.data, (long long)job->entry.st.st_size);
+    else if (job->entry.type == 'l')
+        printf("%s\n", job->entry.data);
+    else
+        printf("\n");
+    return 0;
+}
+
+// Create the directories leading to name, which is below
+// output_directory, unless they exist.
+static void create_parents(const char *output_directory, const char *name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", output_directory, name);
+    char *slash = path + strlen(output_directory) + 1;
+    while ((slash = strchr(slash + 1, '/')) != NULL) {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+}
+
+int dedupe_extract_path(const char *manifest, const char *blob_dir,
+        const char *output_directory, const char *path, int threads,
+        dedupe_callback callback, void *cookie) {
+    struct MANIFEST_READER reader;
+    if (manifest_open(&reader, manifest))
+        return 1;
+    char subtree[PATH_MAX];
+    if (path != NULL) {
+        get_entry_name(path, subtree);
+        manifest_select(&reader, subtree);
+        create_parents(output_directory, subtree);
+    }
+
+    if (callback == NULL)
+        printf("%s\n" , output_directory);
+
+    struct DEDUPE_EXTRACT_CONTEXT context;
+    memset(&context, 0, sizeof(context));
+    context.blob_dir = blob_dir;
+    context.output_directory = output_directory;
+    context.callback = callback;
+    context.cookie = cookie;
+    struct DEDUPE_POOL pool;
+    if (pool_start(&pool, threads, extract_work, extract_finish, &context)) {
+        manifest_close(&reader);
+        return 1;
+    }
+
+    int ret = 0;
+    int found = 0;
+    struct DEDUPE_JOB *job;
+    while (ret == 0 && (job = pool_next_job(&pool)) != NULL) {
+        int next = manifest_next(&reader, &job->entry);
+        if (next <= 0) {
+            ret = next < 0;
+            break;
+        }
+        found++;
+        if (job->entry.type == 'd') {
+            if (create_dir(&context, &job->entry)) {
+                ret = 1;
+                break;
+            }
+        }
+        else if (job->entry.type != 'f' && job->entry.type != 'c' && job->entry.type != 'l') {
+            fprintf(stderr, "Unknown type %c\n", job->entry.type);
+            ret = 1;
+            break;
+        }
+        pool_queue(&pool, job);
+    }
+
+    int pool_ret = pool_finish(&pool);
+    if (ret == 0)
+        ret = pool_ret;
+    finish_dirs(&context);
+    manifest_close(&reader);
+    if (ret == 0 && path != NULL && found == 0) {
+        fprintf(stderr, "%s not found in %s\n", path, manifest);
+        ret = 1;
+    }
+    return ret;
+}
+
+int dedupe_extract(const char *manifest, const char *blob_dir,
+        const char *output_directory, int threads,
+        dedupe_callback callback, void *cookie) {
+    return dedupe_extract_path(manifest, blob_dir, output_directory, NULL, threads, callback, cookie);
+}
+
+// Mark a blob referenced by a manifest as live.  The chunks of a
+// chunked file are marked through its chunk list.
+static int gc_mark(struct KNOWN_BLOBS *live, const char *blob_dir, char type, const char *psum) {
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    if (string_to_sha256(psum, sumdata)) {
+        fprintf(stderr, "Malformed digest %s\n", psum);
+        return 1;
+    }
+    if (known_blobs_contains(live, sumdata))
+        return 0;
+    if (known_blobs_add(live, sumdata))
+        return 1;
+    if (type != 'c')
+        return 0;
+
+    // a list that can't be read may be all that refers to its chunks,
+    // so nothing can safely be collected
+    char *list = read_chunk_list(blob_dir, psum);
+    if (list == NULL) {
+        fprintf(stderr, "Unable to read chunk list %s\n", psum);
+        return 1;
+    }
+    int ret = 0;
+    char *line = list;
+    char *end;
+    while (ret == 0 && (end = strchr(line, '\n')) != NULL) {
+        *end = '\0';
+        char *tab = strchr(line, '\t');
+        if (tab != NULL)
+            *tab = '\0';
+        if (string_to_sha256(line, sumdata) || known_blobs_add(live, sumdata))
+            ret = 1;
+        line = end + 1;
+    }
+    free(list);
+    return ret;
+}
+
+static int gc_mark_manifest(struct KNOWN_BLOBS *live, const char *blob_dir, const char *manifest) {
+    struct MANIFEST_READER reader;
+    if (manifest_open(&reader, manifest))
+        return 1;
+
+    int ret = 0;
+    int next;
+    struct DEDUPE_ENTRY entry;
+    while (ret == 0 && (next = manifest_next(&reader, &entry)) > 0) {
+        if (entry.type == 'f' || entry.type == 'c')
+            ret = gc_mark(live, blob_dir, entry.type, entry.data);
+    }
+    if (next < 0)
+        ret = 1;
+    manifest_close(&reader);
+    return ret;
+}
+
+struct DEDUPE_GC_CONTEXT {
+    struct KNOWN_BLOBS live;
+    int flags;
+    int blobs_kept;
+    int blobs_removed;
+    uint64_t bytes_removed;
+};
+
+static int gc_sweep(void *cookie, const char *path, const char *name) {
+    struct DEDUPE_GC_CONTEXT *context = (struct DEDUPE_GC_CONTEXT *)cookie;
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    int compressed;
+    // leftovers of interrupted backups go too; the lock keeps out
+    // backups that are still running
+    int is_blob = parse_blob_name(name, sumdata, &compressed) == 0;
+    if (!is_blob && strncmp(name, ".blob-", 6) != 0)
+        return 0;
+    if (is_blob && known_blobs_contains(&context->live, sumdata)) {
+        context->blobs_kept++;
+        return 0;
+    }
+
+    struct stat st;
+    if (lstat(path, &st) == 0)
+        context->bytes_removed += st.st_size;
+    if (!(context->flags & DEDUPE_GC_DRY_RUN) && unlink(path)) {
+        fprintf(stderr, "Unable to remove %s\n", path);
+        return 1;
+    }
+    context->blobs_removed++;
+    return 0;
+}
+
+int dedupe_gc(const char *blob_dir, const char **manifests, int flags) {
+    // a dry run removes nothing, so it can share the store
+    int lock = lock_blob_dir(blob_dir, ((flags & DEDUPE_GC_DRY_RUN) ? LOCK_SH : LOCK_EX) | LOCK_NB);
+    if (lock < 0) {
+        fprintf(stderr, "Blob directory %s is in use, not collecting anything\n", blob_dir);
+        return 1;
+    }
+    struct DEDUPE_GC_CONTEXT context;
+    memset(&context, 0, sizeof(context));
+    context.flags = flags;
+    int ret = 0;
+    const char **manifest;
+    for (manifest = manifests; ret == 0 && *manifest != NULL; manifest++)
+        ret = gc_mark_manifest(&context.live, blob_dir, *manifest);
+    if (ret != 0) {
+        fprintf(stderr, "Not collecting anything\n");
+        known_blobs_free(&context.live);
+        close(lock);
+        return ret;
+    }
+
+    ret = for_each_blob(blob_dir, gc_sweep, &context);
+    known_blobs_free(&context.live);
+    close(lock);
+
+    printf("%d blobs in use, %d unreferenced (%lld bytes)%s\n", context.blobs_kept, context.blobs_removed,
+            (long long)context.bytes_removed, (flags & DEDUPE_GC_DRY_RUN) ? ", nothing removed" : " removed");
+    return ret;
+}
+
+int dedupe_migrate(const char *blob_dir) {
+    DIR *dp = opendir(blob_dir);
+    if (dp == NULL) {
+        fprintf(stderr, "Unable to read blob directory %s\n", blob_dir);
+        return 1;
+    }
+    int blobs_moved = 0;
+    int moved;
+    int ret = 0;
+    // the directory changes while it is read, so go over it until
+    // nothing is left to move
+    do {
+        moved = 0;
+        struct dirent *ep;
+        unsigned char sumdata[SHA256_DIGEST_LENGTH];
+        int compressed;
+        while (ret == 0 && (ep = readdir(dp))) {
+            if (parse_blob_name(ep->d_name, sumdata, &compressed) != 0)
+                continue;
+            char blob_file[PATH_MAX];
+            snprintf(blob_file, sizeof(blob_file), "%s/%s", blob_dir, ep->d_name);
+            if (move_blob(blob_file, blob_dir, ep->d_name)) {
+                fprintf(stderr, "Unable to move %s\n", blob_file);
+                ret = 1;
+            }
+            moved++;
+        }
+        blobs_moved += moved;
+        rewinddir(dp);
+    } while (ret == 0 && moved > 0);
+    closedir(dp);
+    printf("%d blobs moved\n", blobs_moved);
+    return ret;
+}
+
+struct DEDUPE_VERIFY_CONTEXT {
+    struct DEDUPE_POOL *pool;
+    struct KNOWN_BLOBS good;
+    struct KNOWN_BLOBS corrupt;
+    int blobs_good;
+    uint64_t bytes;
+};
+
+// Runs on a worker thread.  A damaged blob is what verify is looking
+// for rather than an error, so the result goes back in the entry type:
+// 'g' for good, 'x' for corrupt or unreadable.
+static int verify_work(void *cookie, struct DEDUPE_JOB *job, char *buf) {
+    int compressed = job->entry.type == 'z';
+    int fd = open(job->entry.name, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0)
+        job->entry.st.st_size = st.st_size;
+    int ret = fd < 0 ? 3 : read_blob_fd(fd, compressed, job->entry.data, buf, NULL, NULL);
+    if (ret != 0 && ret != 6)
+        fprintf(stderr, "Unable to read %s\n", job->entry.name);
+    job->entry.type = ret == 0 ? 'g' : 'x';
+    return 0;
+}
+
+// Runs on the calling thread, in the order the blobs were queued.
+static int verify_finish(void *cookie, struct DEDUPE_JOB *job) {
+    struct DEDUPE_VERIFY_CONTEXT *context = (struct DEDUPE_VERIFY_CONTEXT *)cookie;
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    string_to_sha256(job->entry.data, sumdata);
+    context->bytes += job->entry.st.st_size;
+    if (job->entry.type == 'g') {
+        context->blobs_good++;
+        return known_blobs_add(&context->good, sumdata);
+    }
+    return known_blobs_add(&context->corrupt, sumdata);
+}
+
+static int verify_visit(void *cookie, const char *path, const char *name) {
+    struct DEDUPE_VERIFY_CONTEXT *context = (struct DEDUPE_VERIFY_CONTEXT *)cookie;
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    int compressed;
+    if (parse_blob_name(name, sumdata, &compressed) != 0)
+        return 0;
+    struct DEDUPE_JOB *job = pool_next_job(context->pool);
+    if (job == NULL)
+        return context->pool->ret;
+    job->entry.type = compressed ? 'z' : 'r';
+    snprintf(job->entry.name, sizeof(job->entry.name), "%s", path);
+    sha256_to_string(sumdata, job->entry.data);
+    pool_queue(context->pool, job);
+    return 0;
+}
+
+enum { BLOB_GOOD, BLOB_MISSING, BLOB_CORRUPT };
+
+static int get_blob_status(struct DEDUPE_VERIFY_CONTEXT *context, const char *psum) {
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    if (string_to_sha256(psum, sumdata) != 0)
+        return BLOB_MISSING;
+    if (known_blobs_contains(&context->good, sumdata))
+        return BLOB_GOOD;
+    return known_blobs_contains(&context->corrupt, sumdata) ? BLOB_CORRUPT : BLOB_MISSING;
+}
+
+// Check every blob a manifest entry needs.  psum is left naming the
+// first one that is damaged.
+static int verify_entry(struct DEDUPE_VERIFY_CONTEXT *context, const char *blob_dir,
+        char type, char *psum) {
+    int status = get_blob_status(context, psum);
+    if (status != BLOB_GOOD || type != 'c')
+        return status;
+
+    char *list = read_chunk_list(blob_dir, psum);
+    if (list == NULL)
+        return BLOB_CORRUPT;
+    char *line = list;
+    char *end;
+    while (status == BLOB_GOOD && (end = strchr(line, '\n')) != NULL) {
+        *end = '\0';
+        char *tab = strchr(line, '\t');
+        if (tab != NULL)
+            *tab = '\0';
+        if ((status = get_blob_status(context, line)) != BLOB_GOOD)
+            snprintf(psum, PATH_MAX, "%s", line);
+        line = end + 1;
+    }
+    free(list);
+    return status;
+}
+
+static int verify_manifest(struct DEDUPE_VERIFY_CONTEXT *context, const char *blob_dir,
+        const char *manifest) {
+    struct MANIFEST_READER reader;
+    if (manifest_open(&reader, manifest))
+        return 1;
+    int damaged = 0;
+    int next;
+    struct DEDUPE_ENTRY entry;
+    while ((next = manifest_next(&reader, &entry)) > 0) {
+        if (entry.type != 'f' && entry.type != 'c')
+            continue;
+        int status = verify_entry(context, blob_dir, entry.type, entry.data);
+        if (status != BLOB_GOOD) {
+            printf("%s: %s: %s blob %s\n", manifest, entry.name,
+                    status == BLOB_CORRUPT ? "corrupt" : "missing", entry.data);
+            damaged++;
+        }
+    }
+    manifest_close(&reader);
+    if (next < 0)
+        printf("%s: damaged manifest\n", manifest);
+    else if (damaged > 0)
+        printf("%s: %d files can't be restored\n", manifest, damaged);
+    else
+        printf("%s: OK\n", manifest);
+    return next < 0 || damaged > 0;
+}
+
+int dedupe_verify(const char *blob_dir, const char **manifests, int threads) {
+    struct DEDUPE_VERIFY_CONTEXT context;
+    memset(&context, 0, sizeof(context));
+    struct DEDUPE_POOL pool;
+    context.pool = &pool;
+    if (pool_start(&pool, threads, verify_work, verify_finish, &context))
+        return 1;
+    int ret = for_each_blob(blob_dir, verify_visit, &context);
+    int pool_ret = pool_finish(&pool);
+    if (ret == 0)
+        ret = pool_ret;
+
+    int blobs_corrupt = context.corrupt.count;
+    printf("%d blobs (%lld bytes) checked, %d corrupt\n", context.blobs_good + blobs_corrupt,
+            (long long)context.bytes, blobs_corrupt);
+    if (ret == 0 && blobs_corrupt > 0)
+        ret = 1;
+
+    const char **manifest;
+    for (manifest = manifests; manifest != NULL && *manifest != NULL; manifest++) {
+        if (verify_manifest(&context, blob_dir, *manifest))
+            ret = 1;
+    }
+    known_blobs_free(&context.good);
+    known_blobs_free(&context.corrupt);
+    return ret;
+}
+
+int dedupe_pack(const char *manifest, const char *output) {
+    struct MANIFEST_READER reader;
+    if (manifest_open(&reader, manifest))
+        return 1;
+    struct MANIFEST_WRITER writer;
+    memset(&writer, 0, sizeof(writer));
+    int ret = 0;
+    int next;
+    struct DEDUPE_ENTRY entry;
+    while (ret == 0 && (next = manifest_next(&reader, &entry)) > 0)
+        ret = manifest_add(&writer, &entry);
+    if (next < 0)
+        ret = 1;
+    manifest_close(&reader);
+
+    FILE *out = NULL;
+    if (ret == 0 && (out = fopen(output, "wb")) == NULL) {
+        fprintf(stderr, "Unable to open output file %s\n", output);
+        ret = 1;
+    }
+    if (ret == 0)
+        ret = manifest_write(&writer, out);
+    if (out != NULL && fclose(out) && ret == 0)
+        ret = 1;
+    if (ret != 0)
+        fprintf(stderr, "Unable to write output file %s\n", output);
+    manifest_writer_free(&writer);
+    return ret;
+}
+
+// Print a manifest in text form, or only the entry path and what is
+// below it.
+static int print_manifest(const char *manifest, const char *path) {
+    struct MANIFEST_READER reader;
+    if (manifest_open(&reader, manifest))
+        return 1;
+    char subtree[PATH_MAX];
+    if (path != NULL) {
+        get_entry_name(path, subtree);
+        manifest_select(&reader, subtree);
+    }
+    int next;
+    struct DEDUPE_ENTRY entry;
+    while ((next = manifest_next(&reader, &entry)) > 0)
+        print_entry(stdout, &entry);
+    manifest_close(&reader);
+    return next < 0;
+}
+
+int main(int argc, char** argv) {
+    int flags = 0;
+    int threads = 0;
+    const char *path = NULL;
+    int arg = 1;
+    while (arg < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {
+            threads = atoi(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-C") == 0) {
+            flags |= DEDUPE_CHUNK;
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-z") == 0) {
+            flags |= DEDUPE_COMPRESS;
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-B") == 0) {
+            flags |= DEDUPE_BINARY_MANIFEST;
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-p") == 0 && arg + 1 < argc) {
+            path = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-n") == 0) {
+            flags |= DEDUPE_GC_DRY_RUN;
+            arg++;
+        }
+        else {
+            usage(argv);
+            return 1;
+        }
+    }
+
+    if (argc - arg >= 3 && strcmp(argv[arg], "gc") == 0) {
+        return dedupe_gc(argv[arg + 1], (const char **)argv + arg + 2, flags);
+    }
+    if (argc - arg == 2 && strcmp(argv[arg], "migrate") == 0) {
+        return dedupe_migrate(argv[arg + 1]);
+    }
+    if (argc - arg >= 2 && strcmp(argv[arg], "verify") == 0) {
+        return dedupe_verify(argv[arg + 1], (const char **)argv + arg + 2, threads);
+    }
+    if (argc - arg == 3 && strcmp(argv[arg], "pack") == 0) {
+        return dedupe_pack(argv[arg + 1], argv[arg + 2]);
+    }
+    if (argc - arg == 2 && strcmp(argv[arg], "cat") == 0) {
+        return print_manifest(argv[arg + 1], path);
+    }
+
+    if (argc - arg != 4) {
+        usage(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[arg], "c") == 0) {
+        return dedupe_store(argv[arg + 1], argv[arg + 2], argv[arg + 3], NULL, flags, threads, NULL, NULL);
+    }
+    else if (strcmp(argv[arg], "x") == 0) {
+        return dedupe_extract_path(argv[arg + 1], argv[arg + 2], argv[arg + 3], path, threads, NULL, NULL);
     }
     else {
         usage(argv);
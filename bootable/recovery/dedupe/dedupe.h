@@ -0,0 +1,118 @@
+#ifndef DEDUPE_H_
+#define DEDUPE_H_
+
+#include <stdint.h>
+
+/* A dedupe backup is a manifest describing a directory tree, plus a
+ * blob directory that holds the contents of every file exactly once,
+ * named by its SHA-256.  Any number of manifests can share one blob
+ * directory, so each new backup only adds the files that changed.
+ *
+ * Blobs are kept in a subdirectory named after the first two hex
+ * digits of their digest.  Blob directories written before that hold
+ * every blob at the top level; they can still be read and added to.
+ *
+ * The digest is always that of the original contents, even for blobs
+ * that are stored compressed.
+ */
+
+/* Invoked for every entry stored or extracted.  bytes is the running
+ * total of file data processed so far.
+ */
+typedef void (*dedupe_callback)(const char *path, uint64_t bytes, void *cookie);
+
+/* Store the tree at input_directory into blob_dir and describe it in a
+ * new manifest.  Blobs that are already present are not written again.
+ * excludes is a NULL terminated list of paths relative to
+ * input_directory (eg "media") that are skipped along with everything
+ * below them.  excludes and callback may be NULL.
+ *
+ * With DEDUPE_CHUNK in flags large files are split into chunks at
+ * boundaries chosen by their contents, and each chunk is stored as a
+ * blob of its own, so a file that changes in a few places only adds
+ * the chunks around the changes.  The manifest then refers to a blob
+ * listing the chunks ("c" entries instead of "f").  Files of a
+ * megabyte or more are always chunked, so that each is read once and
+ * only its new chunks are written.
+ *
+ * With DEDUPE_COMPRESS new blobs are deflated with zlib unless that
+ * doesn't make them noticeably smaller, and get a ".z" suffix on their
+ * name.  Restore reads both kinds, whatever the flags of the backup.
+ *
+ * With DEDUPE_BINARY_MANIFEST the manifest is written in binary form:
+ * fixed size records sorted by name, which can be mapped and searched
+ * without parsing the whole file.  Every function that reads
+ * manifests accepts both forms.
+ *
+ * Files are hashed and stored on threads worker threads, or one per
+ * core if threads is 0.  The manifest and the callbacks come out in
+ * the same order whatever the thread count.
+ *
+ * Returns 0 on success.
+ */
+#define DEDUPE_CHUNK            1
+#define DEDUPE_BINARY_MANIFEST  2
+#define DEDUPE_COMPRESS         4
+
+int dedupe_store(const char *input_directory, const char *blob_dir,
+        const char *manifest, const char **excludes, int flags, int threads,
+        dedupe_callback callback, void *cookie);
+
+/* Recreate the tree described by manifest below output_directory.
+ * Every blob is checked against its SHA-256 as it is copied.  Files
+ * are restored on threads worker threads as for dedupe_store.
+ *
+ * Returns 0 on success.
+ */
+int dedupe_extract(const char *manifest, const char *blob_dir,
+        const char *output_directory, int threads,
+        dedupe_callback callback, void *cookie);
+
+/* Like dedupe_extract, but only for the entry path (eg "app/Foo.apk" or
+ * "app") and everything below it.  Missing parent directories are
+ * created with default permissions.  A binary manifest is searched
+ * rather than read in full.
+ *
+ * Returns 0 on success, 1 on error or if path is not in the manifest.
+ */
+int dedupe_extract_path(const char *manifest, const char *blob_dir,
+        const char *output_directory, const char *path, int threads,
+        dedupe_callback callback, void *cookie);
+
+/* Write a binary copy of a text manifest.
+ *
+ * Returns 0 on success.
+ */
+int dedupe_pack(const char *manifest, const char *output);
+
+/* Remove every blob in blob_dir that none of manifests, a NULL
+ * terminated list, refers to.  Nothing is removed if any manifest can't
+ * be read, so the list must name every backup that is to be kept.  With
+ * DEDUPE_GC_DRY_RUN in flags the unreferenced blobs and their size are
+ * only reported.  Nothing is collected while a dedupe_store into
+ * blob_dir is running, and stores started meanwhile wait for gc.
+ *
+ * Returns 0 on success.
+ */
+#define DEDUPE_GC_DRY_RUN   1
+
+int dedupe_gc(const char *blob_dir, const char **manifests, int flags);
+
+/* Move the blobs of a blob directory written with every blob at the top
+ * level into their subdirectories.  Safe to run again if interrupted.
+ *
+ * Returns 0 on success.
+ */
+int dedupe_migrate(const char *blob_dir);
+
+/* Check every blob in blob_dir against its digest, on threads worker
+ * threads as for dedupe_store, then check that every file of each of
+ * manifests, a NULL terminated list that may be NULL, only needs blobs
+ * that are present and intact.  Damaged blobs and the files they affect
+ * are reported on stdout.
+ *
+ * Returns 0 if the store and every manifest are intact.
+ */
+int dedupe_verify(const char *blob_dir, const char **manifests, int threads);
+
+#endif  // DEDUPE_H_
@@ -41,6 +41,7 @@
 #include "edify/expr.h"
 #include <libgen.h>
 #include "mtdutils/mtdutils.h"
+#include "tarutils/tarutils.h"
 
 
 int signature_check_enabled = 1;
@@ -715,6 +716,140 @@ void show_partition_menu()
 
 }
 
+typedef struct {
+    const char* prefix;     // directory being browsed, ending in '/'
+    char** names;
+    int count;
+    int capacity;
+} ArchiveDirectory;
+
+// Collect the entries directly below the browsed directory.
+static void archive_directory_callback(const char* name, uint64_t size, void* cookie)
+{
+    ArchiveDirectory* dir = (ArchiveDirectory*)cookie;
+    size_t len = strlen(dir->prefix);
+    if (strncmp(name, dir->prefix, len) != 0 || name[len] == '\0')
+        return;
+    const char* slash = strchr(name + len, '/');
+    if (slash != NULL && slash[1] != '\0')
+        return;
+    if (dir->count + 1 >= dir->capacity) {
+        int capacity = dir->capacity == 0 ? 64 : dir->capacity * 2;
+        char** names = (char**)realloc(dir->names, capacity * sizeof(char*));
+        if (names == NULL)
+            return;
+        dir->names = names;
+        dir->capacity = capacity;
+    }
+    dir->names[dir->count++] = strdup(name + len);
+}
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+static void show_nandroid_file_browser(const char* backup_path, const char* mount_point, const char* image, const char* prefix)
+{
+    ArchiveDirectory dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.prefix = prefix;
+    ui_print("Reading %s...\n", image);
+    if (0 != tar_list(image, archive_directory_callback, &dir)) {
+        ui_print("Error reading %s!\n", image);
+        free(dir.names);
+        return;
+    }
+    qsort(dir.names, dir.count, sizeof(char*), compare_names);
+
+    // first item restores the whole directory
+    char** list = (char**)malloc((dir.count + 2) * sizeof(char*));
+    char restore_all[PATH_MAX];
+    snprintf(restore_all, sizeof(restore_all), "Restore all of /%s", prefix);
+    list[0] = restore_all;
+    int i;
+    for (i = 0; i < dir.count; i++)
+        list[i + 1] = dir.names[i];
+    list[dir.count + 1] = NULL;
+
+    static char* headers[] = {  "Choose a file to restore",
+                                "",
+                                NULL
+    };
+
+    for (;;)
+    {
+        int chosen_item = get_menu_selection(headers, list, 0, 0);
+        if (chosen_item == GO_BACK)
+            break;
+
+        char path[PATH_MAX];
+        if (chosen_item == 0)
+            strcpy(path, prefix);
+        else
+            snprintf(path, sizeof(path), "%s%s", prefix, list[chosen_item]);
+        size_t len = strlen(path);
+        if (chosen_item != 0 && path[len - 1] == '/')
+        {
+            show_nandroid_file_browser(backup_path, mount_point, image, path);
+            continue;
+        }
+
+        char confirm[PATH_MAX];
+        snprintf(confirm, sizeof(confirm), "Yes - Restore /%s", path);
+        if (confirm_selection("Confirm restore?", confirm))
+        {
+            if (path[len - 1] == '/')
+                path[len - 1] = '\0';
+            const char* paths[] = { path, NULL };
+            nandroid_restore_files(backup_path, mount_point, paths);
+        }
+    }
+
+    free(list);
+    for (i = 0; i < dir.count; i++)
+        free(dir.names[i]);
+    free(dir.names);
+}
+
+static void show_nandroid_file_restore_menu(const char* backup_path)
+{
+    static char* headers[] = {  "Restore files from",
+                                "",
+                                NULL
+    };
+
+    static const char* mount_points[] = { "/system", "/data", "/cache", "/sd-ext" };
+    char* list[5];
+    const char* available[4];
+    int count = 0;
+    int i;
+    char image[PATH_MAX];
+    for (i = 0; i < 4; i++)
+    {
+        if (0 == nandroid_find_tar_image(backup_path, mount_points[i], image))
+        {
+            available[count] = mount_points[i];
+            list[count++] = (char*)mount_points[i];
+        }
+    }
+    list[count] = NULL;
+    if (count == 0)
+    {
+        ui_print("No tar backups to restore files from.\n");
+        return;
+    }
+
+    int chosen_item = get_menu_selection(headers, list, 0, 0);
+    if (chosen_item == GO_BACK)
+        return;
+
+    char prefix[PATH_MAX];
+    sprintf(prefix, "%s/", available[chosen_item] + 1);
+    nandroid_find_tar_image(backup_path, available[chosen_item], image);
+    show_nandroid_file_browser(backup_path, available[chosen_item], image, prefix);
+}
+
 void show_nandroid_advanced_restore_menu(const char* path)
 {
     if (ensure_path_mounted("/sdcard") != 0) {
@@ -746,6 +881,7 @@ void show_nandroid_advanced_restore_menu(const char* path)
                             "Restore data",
                             "Restore cache",
                             "Restore sd-ext",
+                            "Restore single files",
                             "Restore wimax",
                             NULL
     };
@@ -753,7 +889,7 @@ void show_nandroid_advanced_restore_menu(const char* path)
     char tmp[PATH_MAX];
     if (0 != get_partition_device("wimax", tmp)) {
         // disable wimax restore option
-        list[4] = NULL;
+        list[5] = NULL;
     }
 
     static char* confirm_restore  = "Confirm restore?";
@@ -778,6 +914,9 @@ void show_nandroid_advanced_restore_menu(const char* path)
                 nandroid_restore(file, 0, 0, 0, 0, 1, 0);
             break;
         case 4:
+            show_nandroid_file_restore_menu(file);
+            break;
+        case 5:
             if (confirm_selection(confirm_restore, "Yes - Restore wimax"))
                 nandroid_restore(file, 0, 0, 0, 0, 0, 1);
             break;
@@ -1,10 +1,15 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
 
 #include "flashutils/flashutils.h"
+#include "flashutils/sparse.h"
 
 #ifndef BOARD_BML_BOOT
 #define BOARD_BML_BOOT              "/dev/block/bml7"
@@ -64,9 +69,37 @@ static int detect_partition(const char *partitionType, const char *partition)
 
     return type;
 }
+static int restore_sparse_partition(int type, const char* partitionType, const char *partition, const char *filename)
+{
+    // eMMC is a plain block device, so the image is written in place
+    // and the empty runs are skipped there.
+    if (type == MMC) {
+        char device[PATH_MAX];
+        if (partition[0] == '/')
+            strcpy(device, partition);
+        else if (cmd_mmc_get_partition_device(partition, device))
+            return -1;
+        return sparse_restore_image(filename, device);
+    }
+
+    // The MTD and BML writers want a complete image they can seek in.
+    char tmp[] = "/tmp/sparse-XXXXXX";
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return -1;
+    close(fd);
+    int ret = sparse_expand_image(filename, tmp);
+    if (ret == 0)
+        ret = restore_raw_partition(partitionType, partition, tmp);
+    unlink(tmp);
+    return ret;
+}
+
 int restore_raw_partition(const char* partitionType, const char *partition, const char *filename)
 {
     int type = detect_partition(partitionType, partition);
+    if (sparse_is_image(filename))
+        return restore_sparse_partition(type, partitionType, partition, filename);
     switch (type) {
         case MTD:
             return cmd_mtd_restore_raw_partition(partition, filename);
@@ -95,6 +128,53 @@ int backup_raw_partition(const char* partitionType, const char *partition, const
     }
 }
 
+typedef struct {
+    int fd;
+    const char *filename;
+    int ret;
+} SparseBackup;
+
+static void *sparse_backup_thread(void *cookie)
+{
+    SparseBackup *backup = (SparseBackup *)cookie;
+    backup->ret = sparse_write_image(backup->fd, backup->filename);
+    // never leave the dumper blocked on a full pipe
+    char buf[4096];
+    while (read(backup->fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+int backup_raw_partition_sparse(const char* partitionType, const char *partition, const char *filename)
+{
+    // The partition is dumped into a pipe and converted on the fly.
+    int fds[2];
+    if (pipe(fds))
+        return -1;
+    // other backups run alongside; a forked child must not hold the
+    // write end open, or the converter never sees EOF
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    SparseBackup backup;
+    backup.fd = fds[0];
+    backup.filename = filename;
+    backup.ret = -1;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sparse_backup_thread, &backup) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    sprintf(path, "/proc/self/fd/%d", fds[1]);
+    int ret = backup_raw_partition(partitionType, partition, path);
+    close(fds[1]);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+    return ret == 0 ? backup.ret : ret;
+}
+
 int erase_raw_partition(const char* partitionType, const char *partition)
 {
     int type = detect_partition(partitionType, partition);
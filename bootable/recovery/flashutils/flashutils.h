@@ -3,6 +3,9 @@
 
 int restore_raw_partition(const char* partitionType, const char *partition, const char *filename);
 int backup_raw_partition(const char* partitionType, const char *partition, const char *filename);
+// Like backup_raw_partition, but filename is written as a sparse image
+// (see sparse.h).  restore_raw_partition accepts either kind.
+int backup_raw_partition_sparse(const char* partitionType, const char *partition, const char *filename);
 int erase_raw_partition(const char* partitionType, const char *partition);
 int erase_partition(const char *partition, const char *filesystem);
 int mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
@@ -0,0 +1,294 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "flashutils/sparse.h"
+
+#ifndef BLKDISCARD
+#define BLKDISCARD          _IO(0x12,119)
+#endif
+
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES    _IO(0x12,124)
+#endif
+
+// Raw runs are buffered until their length is known.
+#define SPARSE_RAW_BUFFER_SIZE  (256 * SPARSE_BLOCK_SIZE)
+#define SPARSE_MAX_RUN          0xfffff000
+
+static int write_fully(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Returns the number of bytes read, short only at end of file.
+static ssize_t read_fully(int fd, void *data, size_t len)
+{
+    char *p = (char *)data;
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = read(fd, p + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+typedef struct {
+    int fd;
+    int type;           // type of the pending run
+    uint32_t length;    // bytes in the pending run
+    char *raw;          // data of a pending raw run
+} SparseWriter;
+
+static int flush_run(SparseWriter *w)
+{
+    if (w->length == 0)
+        return 0;
+    sparse_chunk_header chunk;
+    chunk.type = w->type;
+    chunk.reserved = 0;
+    chunk.length = w->length;
+    if (write_fully(w->fd, &chunk, sizeof(chunk)))
+        return -1;
+    if (w->type == SPARSE_CHUNK_RAW && write_fully(w->fd, w->raw, w->length))
+        return -1;
+    w->length = 0;
+    return 0;
+}
+
+static int block_type(const unsigned char *block, size_t len)
+{
+    if ((block[0] == 0x00 || block[0] == 0xff) && memcmp(block, block + 1, len - 1) == 0)
+        return block[0] == 0x00 ? SPARSE_CHUNK_ZERO : SPARSE_CHUNK_ERASED;
+    return SPARSE_CHUNK_RAW;
+}
+
+int sparse_write_image(int in_fd, const char *filename)
+{
+    SparseWriter w;
+    memset(&w, 0, sizeof(w));
+    w.raw = (char *)malloc(SPARSE_RAW_BUFFER_SIZE);
+    if (w.raw == NULL)
+        return -1;
+    w.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (w.fd < 0) {
+        printf("error opening %s: %s\n", filename, strerror(errno));
+        free(w.raw);
+        return -1;
+    }
+
+    sparse_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SPARSE_MAGIC;
+    header.version = SPARSE_VERSION;
+    header.header_size = sizeof(header);
+    header.block_size = SPARSE_BLOCK_SIZE;
+    int ret = write_fully(w.fd, &header, sizeof(header));
+
+    unsigned char block[SPARSE_BLOCK_SIZE];
+    while (ret == 0) {
+        ssize_t len = read_fully(in_fd, block, sizeof(block));
+        if (len <= 0) {
+            ret = len;
+            break;
+        }
+        int type = block_type(block, len);
+        uint32_t limit = type == SPARSE_CHUNK_RAW ? SPARSE_RAW_BUFFER_SIZE : SPARSE_MAX_RUN;
+        if (type != w.type || w.length + len > limit) {
+            ret = flush_run(&w);
+            w.type = type;
+        }
+        if (type == SPARSE_CHUNK_RAW)
+            memcpy(w.raw + w.length, block, len);
+        w.length += len;
+    }
+
+    if (ret == 0) {
+        ret = flush_run(&w);
+        sparse_chunk_header end;
+        memset(&end, 0, sizeof(end));
+        end.type = SPARSE_CHUNK_END;
+        if (ret == 0)
+            ret = write_fully(w.fd, &end, sizeof(end));
+    }
+    if (close(w.fd) && ret == 0)
+        ret = -1;
+    if (ret)
+        printf("error writing %s\n", filename);
+    free(w.raw);
+    return ret;
+}
+
+static int read_header(int fd, const char *filename)
+{
+    sparse_header header;
+    if (read_fully(fd, &header, sizeof(header)) != sizeof(header) ||
+            header.magic != SPARSE_MAGIC)
+        return -1;
+    if (header.version != SPARSE_VERSION || header.header_size < sizeof(header)) {
+        printf("unsupported sparse image %s\n", filename);
+        return -1;
+    }
+    if (lseek(fd, header.header_size, SEEK_SET) != header.header_size)
+        return -1;
+    return 0;
+}
+
+int sparse_is_image(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    sparse_header header;
+    int ret = read_fully(fd, &header, sizeof(header)) == sizeof(header) &&
+            header.magic == SPARSE_MAGIC;
+    close(fd);
+    return ret;
+}
+
+// Write length bytes of value at the current offset of out_fd.
+static int write_fill(int out_fd, int value, uint64_t length)
+{
+    char buf[SPARSE_BLOCK_SIZE];
+    memset(buf, value, sizeof(buf));
+    while (length > 0) {
+        size_t chunk = length > sizeof(buf) ? sizeof(buf) : length;
+        if (write_fully(out_fd, buf, chunk))
+            return -1;
+        length -= chunk;
+    }
+    return 0;
+}
+
+// Copy the image in filename to out_fd.  Zero runs are turned into
+// holes with lseek for files, or discarded on devices that read
+// discarded blocks back as zeros.
+static int sparse_copy_image(const char *filename, int out_fd, int device)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("error opening %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (read_header(fd, filename)) {
+        printf("%s is not a sparse image\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    unsigned int discard_zeroes = 0;
+    if (device && ioctl(out_fd, BLKDISCARDZEROES, &discard_zeroes))
+        discard_zeroes = 0;
+
+    char *buf = (char *)malloc(SPARSE_RAW_BUFFER_SIZE);
+    if (buf == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    uint64_t offset = 0;
+    int ret = -1;
+    for (;;) {
+        sparse_chunk_header chunk;
+        if (read_fully(fd, &chunk, sizeof(chunk)) != sizeof(chunk)) {
+            printf("truncated sparse image %s\n", filename);
+            break;
+        }
+        if (chunk.type == SPARSE_CHUNK_END) {
+            ret = 0;
+            break;
+        }
+
+        int error = 0;
+        if (chunk.type == SPARSE_CHUNK_RAW) {
+            uint32_t left = chunk.length;
+            while (left > 0 && !error) {
+                size_t len = left > SPARSE_RAW_BUFFER_SIZE ? SPARSE_RAW_BUFFER_SIZE : left;
+                if (read_fully(fd, buf, len) != (ssize_t)len)
+                    break;
+                error = write_fully(out_fd, buf, len);
+                left -= len;
+            }
+            if (left > 0 && !error) {
+                printf("truncated sparse image %s\n", filename);
+                break;
+            }
+        } else if (chunk.type == SPARSE_CHUNK_ZERO) {
+            uint64_t range[2] = { offset, chunk.length };
+            if (!device)
+                error = lseek(out_fd, chunk.length, SEEK_CUR) < 0;
+            else if (discard_zeroes && chunk.length % 512 == 0 && ioctl(out_fd, BLKDISCARD, range) == 0)
+                error = lseek(out_fd, chunk.length, SEEK_CUR) < 0;
+            else
+                error = write_fill(out_fd, 0x00, chunk.length);
+        } else if (chunk.type == SPARSE_CHUNK_ERASED) {
+            error = write_fill(out_fd, 0xff, chunk.length);
+        } else {
+            printf("unknown chunk type %d in %s\n", chunk.type, filename);
+            break;
+        }
+        if (error) {
+            printf("error copying %s: %s\n", filename, strerror(errno));
+            break;
+        }
+        offset += chunk.length;
+    }
+
+    // a file that ends in a hole still needs its full length
+    if (ret == 0 && !device && ftruncate(out_fd, offset))
+        ret = -1;
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+int sparse_expand_image(const char *filename, const char *out_file)
+{
+    int fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        printf("error opening %s: %s\n", out_file, strerror(errno));
+        return -1;
+    }
+    int ret = sparse_copy_image(filename, fd, 0);
+    if (close(fd))
+        ret = -1;
+    return ret;
+}
+
+int sparse_restore_image(const char *filename, const char *device)
+{
+    int fd = open(device, O_WRONLY);
+    if (fd < 0) {
+        printf("error opening %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+    printf("flashing %s from sparse image %s\n", device, filename);
+    int ret = sparse_copy_image(filename, fd, 1);
+    if (fsync(fd) || close(fd))
+        ret = -1;
+    return ret;
+}
@@ -0,0 +1,59 @@
+#ifndef FLASHUTILS_SPARSE_H
+#define FLASHUTILS_SPARSE_H
+
+#include <stdint.h>
+
+/* Sparse raw partition images.
+ *
+ * Boot, recovery and similar partitions are mostly empty: zero filled
+ * on eMMC, erased (0xFF) on NAND.  A sparse image stores those runs as
+ * a length only.  The format can be written as a stream, so it can be
+ * produced while the partition is being read:
+ *
+ *   header:  magic, version, header size, block size
+ *   chunks:  type, length in bytes, then for raw chunks the data
+ *   end:     a chunk of type SPARSE_CHUNK_END
+ *
+ * Runs are detected per block_size block; the last block of a
+ * partition may be short.  All fields are little endian.
+ */
+
+#define SPARSE_MAGIC            0x53574d43      // "CMWS"
+#define SPARSE_VERSION          1
+#define SPARSE_BLOCK_SIZE       4096
+
+#define SPARSE_CHUNK_RAW        1
+#define SPARSE_CHUNK_ZERO       2
+#define SPARSE_CHUNK_ERASED     3
+#define SPARSE_CHUNK_END        4
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t block_size;
+    uint32_t reserved;
+} sparse_header;
+
+typedef struct {
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t length;
+} sparse_chunk_header;
+
+// Read a raw image from in_fd until end of file and write it to
+// filename in sparse form.  Returns 0 on success.
+int sparse_write_image(int in_fd, const char *filename);
+
+// Returns nonzero if filename is a sparse image.
+int sparse_is_image(const char *filename);
+
+// Expand a sparse image into a plain raw image.  Returns 0 on success.
+int sparse_expand_image(const char *filename, const char *out_file);
+
+// Write a sparse image straight to a block device.  Zero runs are
+// discarded when the device guarantees that discarded blocks read back
+// as zeros, and written otherwise.  Returns 0 on success.
+int sparse_restore_image(const char *filename, const char *device);
+
+#endif
@@ -9,8 +9,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>   // for S_ISLNK()
 #include <unistd.h>
 
@@ -18,7 +20,6 @@
 #include "Zip.h"
 #include "Bits.h"
 #include "Log.h"
-#include "DirUtil.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
@@ -511,6 +512,89 @@ const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
                 itemHash, (char*) entryName, hashcmpZipName, false);
 }
 
+#if SORT_ENTRIES
+/*
+ * Compare the start of an entry's name with prefix, in the order used to
+ * sort the entries.  Returns zero if the name begins with prefix, and
+ * otherwise which side of the names that do the entry falls on.
+ */
+static int cmpEntryPrefix(const ZipEntry *pEntry, const char *prefix,
+        unsigned int prefixLen)
+{
+    unsigned int len = pEntry->fileNameLen;
+    if (len > prefixLen) {
+        len = prefixLen;
+    }
+    int diff = strncmp(pEntry->fileName, prefix, len);
+    if (diff == 0 && pEntry->fileNameLen < prefixLen) {
+        diff = -1;
+    }
+    return diff;
+}
+
+/*
+ * Return the index of the first entry for which cmpEntryPrefix() is
+ * at least bound.
+ */
+static unsigned int searchEntryPrefix(const ZipArchive *pArchive,
+        const char *prefix, unsigned int prefixLen, int bound)
+{
+    unsigned int low = 0;
+    unsigned int high = pArchive->numEntries;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (cmpEntryPrefix(pArchive->pEntries + mid, prefix, prefixLen)
+                < bound) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+#endif
+
+/*
+ * Prepare to iterate over the entries whose names begin with prefix.
+ * Since the entries are sorted, the matches are one contiguous run
+ * that can be found with two binary searches.
+ */
+void mzInitZipEntryIterator(ZipEntryIterator *pIter,
+        const ZipArchive *pArchive, const char *prefix)
+{
+    pIter->pArchive = pArchive;
+    pIter->prefix = prefix;
+    pIter->prefixLen = strlen(prefix);
+#if SORT_ENTRIES
+    pIter->index = searchEntryPrefix(pArchive, prefix, pIter->prefixLen, 0);
+    pIter->end = searchEntryPrefix(pArchive, prefix, pIter->prefixLen, 1);
+#else
+    pIter->index = 0;
+    pIter->end = pArchive->numEntries;
+#endif
+}
+
+/*
+ * Return the next entry whose name begins with the prefix, or NULL
+ * when there are no more.
+ */
+const ZipEntry* mzNextZipEntry(ZipEntryIterator *pIter)
+{
+    while (pIter->index < pIter->end) {
+        const ZipEntry *pEntry = pIter->pArchive->pEntries + pIter->index++;
+#if !SORT_ENTRIES
+        if (pEntry->fileNameLen < pIter->prefixLen ||
+                strncmp(pEntry->fileName, pIter->prefix,
+                        pIter->prefixLen) != 0) {
+            continue;
+        }
+#endif
+        return pEntry;
+    }
+    return NULL;
+}
+
 /*
  * Return true if the entry is a symbolic link.
  */
@@ -522,32 +606,54 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+#define MZ_PAGE_SIZE            4096
+
+/*
+ * Ask the kernel to start reading [start, end) of the archive through
+ * its mapping.
+ */
+static void adviseWillNeed(const ZipArchive *pArchive, long start, long end)
+{
+    start &= ~(long)(MZ_PAGE_SIZE - 1);
+    if (end > (long)pArchive->map.length) {
+        end = pArchive->map.length;
+    }
+    if (start >= end) {
+        return;
+    }
+    madvise((char *)pArchive->map.addr + start, end - start, MADV_WILLNEED);
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
+ * The data is passed straight out of the archive's mapping, so nothing
+ * is copied on the way; each piece is requested from the kernel while
+ * the one before it is being processed.
  */
+#define STORED_CHUNK_SIZE   (1024 * 1024)
+
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
+    const unsigned char *data =
+            (const unsigned char *)pArchive->map.addr + pEntry->offset;
+    long offset = pEntry->offset;
     size_t bytesLeft = pEntry->compLen;
+
     while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
-        size_t count;
-        bool ret;
-
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
+        size_t count = bytesLeft;
+        if (count > STORED_CHUNK_SIZE) {
+            count = STORED_CHUNK_SIZE;
         }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
-            return false;
+        if (bytesLeft > count) {
+            adviseWillNeed(pArchive, offset + count,
+                    offset + count + STORED_CHUNK_SIZE);
         }
-        ret = processFunction(buf, n, cookie);
-        if (!ret) {
+        if (!processFunction(data, count, cookie)) {
             return false;
         }
+        data += count;
+        offset += count;
         bytesLeft -= count;
     }
     return true;
@@ -563,8 +669,10 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     z_stream zstream;
     int zerr;
     long compRemaining;
+    off_t offset;
 
     compRemaining = pEntry->compLen;
+    offset = pEntry->offset;
 
     /*
      * Initialize the zlib stream.
@@ -605,12 +713,13 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
             LOGVV("+++ reading %ld bytes (%ld left)\n",
                 getSize, compRemaining);
 
-            int cc = read(pArchive->fd, readBuf, getSize);
+            int cc = pread(pArchive->fd, readBuf, getSize, offset);
             if (cc != (int) getSize) {
                 LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
                 goto z_bail;
             }
 
+            offset += getSize;
             compRemaining -= getSize;
 
             zstream.next_in = readBuf;
@@ -668,19 +777,15 @@ bail:
  * mzProcessZipEntryContents() immediately returns false.
  *
  * This is useful for calculating the hash of an entry's uncompressed contents.
+ *
+ * The archive is read with pread() and its file offset is left alone, so
+ * different entries may be processed on different threads at once.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,8 +800,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -847,6 +950,20 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
 }
 
 
+/*
+ * Return a pointer to the contents of a stored (uncompressed) entry in
+ * the archive's mapping, or NULL if the entry is compressed.
+ */
+const unsigned char* mzBorrowZipEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    if (pEntry->compression != STORED ||
+            pEntry->compLen != pEntry->uncompLen) {
+        return NULL;
+    }
+    return (const unsigned char *)pArchive->map.addr + pEntry->offset;
+}
+
 /* Helper state to make path translation easier and less malloc-happy.
  */
 typedef struct {
@@ -862,7 +979,8 @@ typedef struct {
  * return the target filename of the provided entry.
  * The helper must be initialized first.
  */
-static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
+static const char *targetEntryPath(MzPathHelper *helper,
+        const ZipEntry *pEntry)
 {
     int needLen;
     bool firstTime = (helper->buf == NULL);
@@ -907,6 +1025,423 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/*
+ * Directories known to exist during one mzExtractRecursive() call are
+ * kept in a hash table of paths, so each one costs a single mkdir() (and
+ * a stat() if it was already there) instead of dirCreateHierarchy()
+ * checking every component again for every file.
+ */
+static int hashcmpDirPath(const void *tableItem, const void *looseItem)
+{
+    return strcmp((const char *)tableItem, (const char *)looseItem);
+}
+
+/*
+ * Make sure that the first len characters of path name a directory,
+ * creating it and any missing parents with mode, and remember it in
+ * pDirs.  New directories get timestamp if it is non-NULL.
+ *
+ * Returns false, with errno set, on failure.
+ */
+static bool createDirCached(HashTable *pDirs, const char *path, size_t len,
+        int mode, const struct utimbuf *timestamp)
+{
+    while (len > 1 && path[len-1] == '/') {
+        len--;
+    }
+    if (len == 0) {
+        errno = ENOENT;
+        return false;
+    }
+
+    char *dir = (char *)malloc(len + 1);
+    if (dir == NULL) {
+        errno = ENOMEM;
+        return false;
+    }
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    unsigned int hash = computeHash(dir, len);
+    if (mzHashTableLookup(pDirs, hash, dir, hashcmpDirPath, false) != NULL) {
+        free(dir);
+        return true;
+    }
+
+    /* Make sure the parent exists first.
+     */
+    char *slash = strrchr(dir, '/');
+    if (slash != NULL && slash != dir &&
+            !createDirCached(pDirs, dir, slash - dir, mode, timestamp)) {
+        free(dir);
+        return false;
+    }
+
+    if (mkdir(dir, mode) == 0) {
+        if (timestamp != NULL && utime(dir, timestamp) != 0) {
+            free(dir);
+            return false;
+        }
+    } else {
+        struct stat st;
+        if (errno != EEXIST) {
+            free(dir);
+            return false;
+        }
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            free(dir);
+            errno = ENOTDIR;
+            return false;
+        }
+    }
+
+    /* The table owns dir from here on.
+     */
+    mzHashTableLookup(pDirs, hash, dir, hashcmpDirPath, true);
+    return true;
+}
+
+/*
+ * Write a regular file entry to targetFile.  Safe to call from any thread.
+ */
+static bool extractFileEntry(const ZipArchive *pArchive,
+        const ZipEntry *pEntry, const char *targetFile,
+        const struct utimbuf *timestamp)
+{
+    int fd = creat(targetFile, UNZIP_FILEMODE);
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    close(fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+/*
+ * Make targetFile a symbolic link to the target stored as the data of
+ * pEntry.
+ */
+static bool extractSymlinkEntry(const ZipArchive *pArchive,
+        const ZipEntry *pEntry, const char *targetFile)
+{
+    if (pEntry->uncompLen == 0) {
+        LOGE("Symlink entry \"%s\" has no target\n", targetFile);
+        return false;
+    }
+    char *linkTarget = malloc(pEntry->uncompLen + 1);
+    if (linkTarget == NULL) {
+        return false;
+    }
+    if (!mzReadZipEntry(pArchive, pEntry, linkTarget, pEntry->uncompLen)) {
+        LOGE("Can't read symlink target for \"%s\"\n", targetFile);
+        free(linkTarget);
+        return false;
+    }
+    linkTarget[pEntry->uncompLen] = '\0';
+
+    if (symlink(linkTarget, targetFile) != 0) {
+        LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
+                targetFile, linkTarget, strerror(errno));
+        free(linkTarget);
+        return false;
+    }
+    LOGD("Extracted symlink \"%s\" -> \"%s\"\n", targetFile, linkTarget);
+    free(linkTarget);
+    return true;
+}
+
+/*
+ * Worker pool for MZ_EXTRACT_PARALLEL.
+ *
+ * Every matching entry gets a job in a ring, in the order the entries
+ * are visited.  Regular files are extracted by the workers.  Directories
+ * and symlinks are cheap, so they are made on the calling thread, as is
+ * the containing directory of each file before it is queued.  Jobs are
+ * retired from the oldest end of the ring on the calling thread, so the
+ * callback sees the entries in the same order as without workers, and
+ * never sees anything after the first failure.
+ *
+ * Without workers the same ring is used, but every job is done before
+ * it is queued.
+ */
+#define MZ_EXTRACT_MAX_THREADS  4
+#define MZ_EXTRACT_RING         32      // must be a power of two
+
+enum { MZ_JOB_QUEUED, MZ_JOB_RUNNING, MZ_JOB_DONE };
+
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    int state;
+    bool ok;
+} MzExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    void (*callback)(const char *fn, void *);
+    void *cookie;
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      // a job was queued, or quit was set
+    pthread_cond_t done;        // a job is done
+    pthread_t threads[MZ_EXTRACT_MAX_THREADS];
+    int numThreads;
+
+    MzExtractJob jobs[MZ_EXTRACT_RING];
+    unsigned int head;          // oldest job not yet retired
+    unsigned int next;          // next job for a worker to look at
+    unsigned int tail;          // where the next job goes
+    bool failed;                // some job failed; skip the queued ones
+    bool quit;
+
+    bool ok;                    // every retired job succeeded
+} MzExtractPool;
+
+static void *extractWorker(void *arg)
+{
+    MzExtractPool *pool = (MzExtractPool *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->next != pool->tail &&
+                pool->jobs[pool->next % MZ_EXTRACT_RING].state !=
+                        MZ_JOB_QUEUED) {
+            pool->next++;
+        }
+        if (pool->next == pool->tail) {
+            if (pool->quit) {
+                break;
+            }
+            pthread_cond_wait(&pool->queued, &pool->lock);
+            continue;
+        }
+
+        MzExtractJob *job = &pool->jobs[pool->next++ % MZ_EXTRACT_RING];
+        job->state = MZ_JOB_RUNNING;
+        if (pool->failed) {
+            job->ok = false;
+        } else {
+            pthread_mutex_unlock(&pool->lock);
+            job->ok = extractFileEntry(pool->pArchive, job->pEntry,
+                    job->targetFile, pool->timestamp);
+            pthread_mutex_lock(&pool->lock);
+            if (!job->ok) {
+                pool->failed = true;
+            }
+        }
+        job->state = MZ_JOB_DONE;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void startExtractPool(MzExtractPool *pool, const ZipArchive *pArchive,
+        int flags, const struct utimbuf *timestamp,
+        void (*callback)(const char *fn, void *), void *cookie)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->pArchive = pArchive;
+    pool->timestamp = timestamp;
+    pool->callback = callback;
+    pool->cookie = cookie;
+    pool->ok = true;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    if (!(flags & MZ_EXTRACT_PARALLEL) || (flags & MZ_EXTRACT_DRY_RUN)) {
+        return;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > MZ_EXTRACT_MAX_THREADS) {
+        cpus = MZ_EXTRACT_MAX_THREADS;
+    }
+    /* A single worker would only add overhead.
+     */
+    if (cpus < 2) {
+        return;
+    }
+    while (pool->numThreads < cpus) {
+        int err = pthread_create(&pool->threads[pool->numThreads], NULL,
+                extractWorker, pool);
+        if (err != 0) {
+            LOGW("Can't start extraction thread: %s\n", strerror(err));
+            break;
+        }
+        pool->numThreads++;
+    }
+}
+
+/*
+ * Retire the oldest job, waiting for it if it isn't done yet.
+ */
+static void retireJob(MzExtractPool *pool)
+{
+    MzExtractJob *job = &pool->jobs[pool->head % MZ_EXTRACT_RING];
+
+    pthread_mutex_lock(&pool->lock);
+    while (job->state != MZ_JOB_DONE) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!job->ok) {
+        pool->ok = false;
+    }
+    if (pool->ok && pool->callback != NULL) {
+        pool->callback(job->targetFile, pool->cookie);
+    }
+    free(job->targetFile);
+    job->targetFile = NULL;
+    pool->head++;
+}
+
+/*
+ * Retire every job at the old end of the ring that is already done.
+ */
+static void retireDoneJobs(MzExtractPool *pool)
+{
+    while (pool->head != pool->tail) {
+        MzExtractJob *job = &pool->jobs[pool->head % MZ_EXTRACT_RING];
+
+        pthread_mutex_lock(&pool->lock);
+        bool done = (job->state == MZ_JOB_DONE);
+        pthread_mutex_unlock(&pool->lock);
+        if (!done) {
+            break;
+        }
+        retireJob(pool);
+    }
+}
+
+/*
+ * Add a job for pEntry to the ring.  With queue set it is left to the
+ * workers, otherwise it has already been done and ok is its result.
+ * Returns false if the job couldn't be added.
+ */
+static bool addJob(MzExtractPool *pool, const ZipEntry *pEntry,
+        const char *targetFile, bool queue, bool ok)
+{
+    if (pool->tail - pool->head == MZ_EXTRACT_RING) {
+        retireJob(pool);
+    }
+    MzExtractJob *job = &pool->jobs[pool->tail % MZ_EXTRACT_RING];
+    job->pEntry = pEntry;
+    job->targetFile = strdup(targetFile);
+    if (job->targetFile == NULL) {
+        LOGE("Can't allocate path for \"%s\"\n", targetFile);
+        return false;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    job->state = queue ? MZ_JOB_QUEUED : MZ_JOB_DONE;
+    job->ok = ok;
+    if (!ok) {
+        pool->failed = true;
+    }
+    pool->tail++;
+    if (queue) {
+        pthread_cond_signal(&pool->queued);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    retireDoneJobs(pool);
+    return true;
+}
+
+/*
+ * Retire every outstanding job and stop the workers.  Returns true if
+ * every job succeeded.
+ */
+static bool finishExtractPool(MzExtractPool *pool)
+{
+    while (pool->head != pool->tail) {
+        retireJob(pool);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+
+    int i;
+    for (i = 0; i < pool->numThreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->queued);
+    pthread_mutex_destroy(&pool->lock);
+    return pool->ok;
+}
+
+static int cmpEntryOffset(const void *a, const void *b)
+{
+    long offsetA = (*(const ZipEntry **)a)->offset;
+    long offsetB = (*(const ZipEntry **)b)->offset;
+
+    return (offsetA > offsetB) - (offsetA < offsetB);
+}
+
+/*
+ * Read-ahead for extraction.  Reading each entry 32K at a time gives the
+ * kernel little to go on, and with workers several entries are read at
+ * once.  So as each entry is about to be extracted, the data of the
+ * entries after it, up to MZ_READAHEAD_WINDOW bytes past its end, is
+ * requested through the archive's mapping.  Entries less than
+ * MZ_READAHEAD_GAP apart are requested as one range, which also covers
+ * the local headers between them.
+ */
+#define MZ_READAHEAD_WINDOW     (2 * 1024 * 1024)
+#define MZ_READAHEAD_GAP        (64 * 1024)
+
+/*
+ * Called before entries[current] of a list sorted by offset is
+ * extracted.  *pNext is the first entry that hasn't been requested yet.
+ */
+static void readAheadEntries(const ZipArchive *pArchive,
+        const ZipEntry **entries, unsigned int numEntries,
+        unsigned int current, unsigned int *pNext)
+{
+    const ZipEntry *pCurrent = entries[current];
+    long limit = pCurrent->offset + pCurrent->compLen + MZ_READAHEAD_WINDOW;
+    unsigned int next = *pNext;
+
+    if (next <= current) {
+        next = current;
+    }
+    while (next < numEntries && entries[next]->offset < limit) {
+        long start = entries[next]->offset;
+        long end = start + entries[next]->compLen;
+        next++;
+        while (next < numEntries && entries[next]->offset < limit &&
+                entries[next]->offset - end < MZ_READAHEAD_GAP) {
+            end = entries[next]->offset + entries[next]->compLen;
+            next++;
+        }
+        adviseWillNeed(pArchive, start, end < limit ? end : limit);
+    }
+    *pNext = next;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -976,50 +1511,60 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
-     */
-    unsigned int i;
-    bool seenMatch = false;
-    int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+    /* Collect the entries whose path begins with zpath.
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
+     */
+    ZipEntryIterator iter;
+    mzInitZipEntryIterator(&iter, pArchive, zpath);
+
+    unsigned int maxMatches = mzZipEntryIteratorRemaining(&iter);
+    const ZipEntry **matches = (const ZipEntry **)malloc(
+            (maxMatches + 1) * sizeof(*matches));
+    if (matches == NULL) {
+        LOGE("Can't allocate list of %u entries\n", maxMatches);
+        free(zpath);
+        return false;
+    }
+    unsigned int numMatches = 0;
+    const ZipEntry *pEntry;
+    while ((pEntry = mzNextZipEntry(&iter)) != NULL) {
+        matches[numMatches++] = pEntry;
+    }
+
+    /* Extract the entries in the order they are stored, so the archive
+     * is read front to back instead of seeking around in name order.
+     */
+    qsort(matches, numMatches, sizeof(*matches), cmpEntryOffset);
+
+    HashTable *pDirs = mzHashTableCreate(mzHashSize(numMatches + 1), free);
+    if (pDirs == NULL) {
+        LOGE("Can't allocate directory table\n");
+        free(matches);
+        free(zpath);
+        return false;
+    }
+
+    MzExtractPool pool;
+    startExtractPool(&pool, pArchive, flags, timestamp, callback, cookie);
+
+    unsigned int readAhead = 0;
+    unsigned int i;
+    int ok = true;
+    for (i = 0; i < numMatches; i++) {
+        pEntry = matches[i];
+
+        /* Stop at the first failure, even one on a worker.
          */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
+        pthread_mutex_lock(&pool.lock);
+        bool failed = pool.failed;
+        pthread_mutex_unlock(&pool.lock);
+        if (failed) {
+            ok = false;
+            break;
         }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
 
         /* Find the target location of the entry.
          */
@@ -1034,114 +1579,66 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         /* With DRY_RUN set, invoke the callback but don't do anything else.
          */
         if (flags & MZ_EXTRACT_DRY_RUN) {
-            if (callback != NULL) callback(targetFile, cookie);
+            if (!addJob(&pool, pEntry, targetFile, false, true)) {
+                ok = false;
+                break;
+            }
             continue;
         }
 
+        readAheadEntries(pArchive, matches, numMatches, i, &readAhead);
+
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
+        bool queue = false;
+        bool done = true;
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
-                int ret = dirCreateHierarchy(
-                        targetFile, UNZIP_DIRMODE, timestamp, false);
-                if (ret != 0) {
+                if (!createDirCached(pDirs, targetFile, strlen(targetFile),
+                        UNZIP_DIRMODE, timestamp)) {
                     LOGE("Can't create containing directory for \"%s\": %s\n",
                             targetFile, strerror(errno));
-                    ok = false;
-                    break;
+                    done = false;
+                } else {
+                    LOGD("Extracted dir \"%s\"\n", targetFile);
                 }
-                LOGD("Extracted dir \"%s\"\n", targetFile);
             }
         } else {
             /* This is not a directory.  First, make sure that
              * the containing directory exists.
              */
-            int ret = dirCreateHierarchy(
-                    targetFile, UNZIP_DIRMODE, timestamp, true);
-            if (ret != 0) {
+            const char *slash = strrchr(targetFile, '/');
+            if (!createDirCached(pDirs, targetFile, slash - targetFile,
+                    UNZIP_DIRMODE, timestamp)) {
                 LOGE("Can't create containing directory for \"%s\": %s\n",
                         targetFile, strerror(errno));
-                ok = false;
-                break;
-            }
-
-            /* With FILES_ONLY set, we need to ignore metadata entirely,
-             * so treat symlinks as regular files.
-             */
-            if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
-                /* The entry is a symbolic link.
-                 * The relative target of the symlink is in the
-                 * data section of this entry.
+                done = false;
+            } else if (!(flags & MZ_EXTRACT_FILES_ONLY) &&
+                    mzIsZipEntrySymlink(pEntry)) {
+                /* With FILES_ONLY set, we need to ignore metadata
+                 * entirely, so symlinks are treated as regular files.
                  */
-                if (pEntry->uncompLen == 0) {
-                    LOGE("Symlink entry \"%s\" has no target\n",
-                            targetFile);
-                    ok = false;
-                    break;
-                }
-                char *linkTarget = malloc(pEntry->uncompLen + 1);
-                if (linkTarget == NULL) {
-                    ok = false;
-                    break;
-                }
-                ok = mzReadZipEntry(pArchive, pEntry, linkTarget,
-                        pEntry->uncompLen);
-                if (!ok) {
-                    LOGE("Can't read symlink target for \"%s\"\n",
-                            targetFile);
-                    free(linkTarget);
-                    break;
-                }
-                linkTarget[pEntry->uncompLen] = '\0';
-
-                /* Make the link.
-                 */
-                ret = symlink(linkTarget, targetFile);
-                if (ret != 0) {
-                    LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
-                            targetFile, linkTarget, strerror(errno));
-                    free(linkTarget);
-                    ok = false;
-                    break;
-                }
-                LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
-                        targetFile, linkTarget);
-                free(linkTarget);
+                done = extractSymlinkEntry(pArchive, pEntry, targetFile);
+            } else if (pool.numThreads > 0) {
+                queue = true;
             } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
-                 */
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
+                done = extractFileEntry(pArchive, pEntry, targetFile,
+                        timestamp);
             }
         }
 
-        if (callback != NULL) callback(targetFile, cookie);
+        if (!addJob(&pool, pEntry, targetFile, queue, done) || !done) {
+            ok = false;
+            break;
+        }
+    }
+
+    if (!finishExtractPool(&pool)) {
+        ok = false;
     }
 
+    mzHashTableFree(pDirs);
+    free(matches);
     free(helper.buf);
     free(zpath);
 
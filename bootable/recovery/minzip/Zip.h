@@ -78,6 +78,42 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Iterate over the entries whose names begin with a prefix (eg
+ * "system/"), in name order.  Finding them costs a binary search, not a
+ * pass over the whole archive.  An empty prefix selects every entry.
+ *
+ *     ZipEntryIterator iter;
+ *     const ZipEntry* pEntry;
+ *
+ *     mzInitZipEntryIterator(&iter, pArchive, "system/");
+ *     while ((pEntry = mzNextZipEntry(&iter)) != NULL) {
+ *         ...
+ *     }
+ *
+ * prefix must stay valid until the iteration is done.  Treat the
+ * iterator as opaque.
+ */
+typedef struct {
+    const ZipArchive* pArchive;
+    const char* prefix;
+    unsigned int prefixLen;
+    unsigned int index;
+    unsigned int end;
+} ZipEntryIterator;
+
+void mzInitZipEntryIterator(ZipEntryIterator* pIter,
+        const ZipArchive* pArchive, const char* prefix);
+const ZipEntry* mzNextZipEntry(ZipEntryIterator* pIter);
+
+/*
+ * Get an upper bound on the number of entries the iterator has left.
+ */
+INLINE unsigned int
+mzZipEntryIteratorRemaining(const ZipEntryIterator* pIter) {
+    return pIter->end - pIter->index;
+}
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -145,6 +181,7 @@ typedef bool (*ProcessZipEntryContentsFunction)(const unsigned char *data,
  * mzProcessZipEntryContents() immediately returns false.
  *
  * This is useful for calculating the hash of an entry's uncompressed contents.
+ * Entries may be processed on several threads at once.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
@@ -175,6 +212,16 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char* buffer);
 
+/*
+ * Like mzExtractZipEntryToBuffer(), but for a stored (uncompressed) entry
+ * return a pointer to its mzGetZipEntryUncompLen(pEntry) bytes inside
+ * the mapped archive instead of copying them.  The data must not be
+ * modified and is only valid until the archive is closed.  Returns NULL
+ * if the entry is compressed.
+ */
+const unsigned char* mzBorrowZipEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry);
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -197,14 +244,25 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_PARALLEL - inflate and write files on one thread per core
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
- * If callback is non-NULL, it will be invoked with each unpacked file.
+ * Entries are unpacked in the order they are stored in the archive, so
+ * that it is read sequentially.
+ *
+ * If callback is non-NULL, it will be invoked with each unpacked file,
+ * on the calling thread and in that same order with or without
+ * MZ_EXTRACT_PARALLEL.  It is not invoked for anything after the first
+ * entry that fails.
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum {
+    MZ_EXTRACT_FILES_ONLY = 1,
+    MZ_EXTRACT_DRY_RUN = 2,
+    MZ_EXTRACT_PARALLEL = 4
+};
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
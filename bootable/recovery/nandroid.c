@@ -19,6 +19,7 @@
 
 #include <signal.h>
 #include <sys/wait.h>
+#include <pthread.h>
 
 #include "bootloader.h"
 #include "common.h"
@@ -40,7 +41,10 @@
 #include "mounts.h"
 
 #include "flashutils/flashutils.h"
+#include "tarutils/tarutils.h"
+#include "dedupe/dedupe.h"
 #include <libgen.h>
+#include <openssl/md5.h>
 
 void nandroid_generate_timestamp_path(const char* backup_path)
 {
@@ -63,8 +67,152 @@ static int print_and_error(const char* message) {
     return 1;
 }
 
-static int yaffs_files_total = 0;
-static int yaffs_files_count = 0;
+// Backups can run several partitions at once, so every partition feeds
+// the same byte counters, which drive one combined progress bar and an
+// ETA/throughput line.
+static pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t progress_bytes_total = 0;
+static uint64_t progress_bytes_done = 0;
+static time_t progress_start = 0;
+static time_t progress_last_update = 0;
+static int progress_show_stats = 0;
+
+typedef struct {
+    uint64_t estimate;      // expected bytes, from the filesystem counters
+    uint64_t bytes;         // bytes processed so far
+} NandroidProgress;
+
+static void nandroid_progress_reset(int show_stats)
+{
+    pthread_mutex_lock(&progress_mutex);
+    progress_bytes_total = 0;
+    progress_bytes_done = 0;
+    progress_start = time(NULL);
+    progress_last_update = 0;
+    progress_show_stats = show_stats;
+    pthread_mutex_unlock(&progress_mutex);
+}
+
+static void nandroid_progress_expect(NandroidProgress* progress, uint64_t estimate)
+{
+    pthread_mutex_lock(&progress_mutex);
+    progress->estimate = estimate;
+    progress->bytes = 0;
+    progress_bytes_total += estimate;
+    pthread_mutex_unlock(&progress_mutex);
+}
+
+static void nandroid_progress_add(NandroidProgress* progress, uint64_t bytes)
+{
+    char stats[64];
+    stats[0] = '\0';
+
+    pthread_mutex_lock(&progress_mutex);
+    // The total always counts max(estimate, bytes) for every partition,
+    // so a low estimate can't push the bar past the end.
+    if (progress->bytes + bytes > progress->estimate) {
+        uint64_t over = progress->bytes > progress->estimate ? progress->bytes : progress->estimate;
+        progress_bytes_total += progress->bytes + bytes - over;
+    }
+    progress->bytes += bytes;
+    progress_bytes_done += bytes;
+    float fraction = 0;
+    if (progress_bytes_total != 0)
+        fraction = (float)progress_bytes_done / (float)progress_bytes_total;
+
+    time_t now = time(NULL);
+    if (progress_show_stats && now != progress_last_update && now > progress_start) {
+        progress_last_update = now;
+        uint64_t rate = progress_bytes_done / (now - progress_start);
+        uint64_t eta = rate == 0 ? 0 : (progress_bytes_total - progress_bytes_done) / rate;
+        sprintf(stats, "%lluMB of %lluMB, %.1fMB/s, %llu:%02llu left",
+                progress_bytes_done >> 20, progress_bytes_total >> 20,
+                (float)rate / (1024 * 1024), eta / 60, eta % 60);
+    }
+    pthread_mutex_unlock(&progress_mutex);
+
+    ui_set_progress(fraction);
+    if (stats[0] != '\0') {
+        ui_print("%s", stats);
+        ui_reset_text_col();
+    }
+}
+
+// Replace the estimate of a finished partition with what it really took.
+static void nandroid_progress_finish(NandroidProgress* progress)
+{
+    pthread_mutex_lock(&progress_mutex);
+    if (progress->estimate > progress->bytes)
+        progress_bytes_total -= progress->estimate - progress->bytes;
+    progress->estimate = progress->bytes;
+    pthread_mutex_unlock(&progress_mutex);
+}
+
+// Sum up the regular files under path, skipping the subtree exclude
+// (an absolute path, or NULL).
+static uint64_t nandroid_directory_size(const char* path, const char* exclude)
+{
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+    uint64_t size = 0;
+    char tmp[PATH_MAX];
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        struct stat st;
+        snprintf(tmp, sizeof(tmp), "%s/%s", path, de->d_name);
+        if (exclude != NULL && strcmp(tmp, exclude) == 0)
+            continue;
+        if (lstat(tmp, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            size += nandroid_directory_size(tmp, exclude);
+        else if (S_ISREG(st.st_mode))
+            size += st.st_size;
+    }
+    closedir(dir);
+    return size;
+}
+
+// /data/media is the internal sdcard on devices without a separate
+// sdcard volume, and is left out of the /data backup.
+static int nandroid_excludes_data_media(const char* backup_path)
+{
+    return strcmp(backup_path, "/data") == 0 && volume_for_path("/sdcard") == NULL;
+}
+
+// Estimate the size of a backup of path from the statfs block and inode
+// counters instead of walking the tree.  Directories that aren't mount
+// points (.android_secure) are small, and are summed up instead.  The
+// counters can't leave out an excluded subtree, which may be most of
+// /data, so those volumes are walked as well.
+static uint64_t nandroid_estimate_backup_size(const char* path, int yaffs)
+{
+    char parent[PATH_MAX];
+    struct stat st, parent_st;
+    snprintf(parent, sizeof(parent), "%s/..", path);
+    if (stat(path, &st) != 0 || stat(parent, &parent_st) != 0)
+        return 0;
+    if (st.st_dev == parent_st.st_dev)
+        return nandroid_directory_size(path, NULL);
+    if (nandroid_excludes_data_media(path))
+        return nandroid_directory_size(path, "/data/media");
+
+    struct statfs s;
+    if (statfs(path, &s) != 0)
+        return 0;
+    uint64_t bytes = (uint64_t)(s.f_blocks - s.f_bfree) * s.f_bsize;
+    uint64_t inodes = s.f_files - s.f_ffree;
+    if (yaffs) {
+        // every 2048 byte chunk carries 64 bytes of spare, and every
+        // object gets a header chunk of its own
+        bytes = bytes / 2048 * 2112 + inodes * 2112;
+    }
+    return bytes;
+}
+
 static void yaffs_callback(const char* filename)
 {
     if (filename == NULL)
@@ -76,56 +224,259 @@ static void yaffs_callback(const char* filename)
         tmp[strlen(tmp) - 1] = NULL;
     if (strlen(tmp) < 30)
         ui_print("%s", tmp);
-    yaffs_files_count++;
-    if (yaffs_files_total != 0)
-        ui_set_progress((float)yaffs_files_count / (float)yaffs_files_total);
     ui_reset_text_col();
 }
 
-static void compute_directory_stats(const char* directory)
-{
-    char tmp[PATH_MAX];
-    sprintf(tmp, "find %s | wc -l > /tmp/dircount", directory);
-    __system(tmp);
-    char count_text[100];
-    FILE* f = fopen("/tmp/dircount", "r");
-    fread(count_text, 1, sizeof(count_text), f);
-    fclose(f);
-    yaffs_files_count = 0;
-    yaffs_files_total = atoi(count_text);
-    ui_reset_progress();
-    ui_show_progress(1, 0);
+// Images are checksummed while they are being written, so nandroid.md5
+// is produced without reading the whole backup back from the sdcard.
+typedef struct {
+    char filename[PATH_MAX];        // empty until the image is complete
+    char md5[MD5_DIGEST_LENGTH * 2 + 1];
+} NandroidChecksum;
+
+static void nandroid_checksum_finish(NandroidChecksum* checksum, const char* filename, MD5_CTX* ctx) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_Final(digest, ctx);
+    int i;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(checksum->md5 + 2 * i, "%02x", digest[i]);
+    strcpy(checksum->filename, filename);
+}
+
+static int nandroid_checksum_file(NandroidChecksum* checksum, const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        MD5_Update(&ctx, buf, n);
+    close(fd);
+    if (n < 0)
+        return -1;
+    nandroid_checksum_finish(checksum, filename, &ctx);
+    return 0;
+}
+
+// mkyaffs2image and the raw partition dumpers insist on opening their
+// output by name.  They are given the write end of a pipe instead (as
+// /proc/self/fd/N), and a thread hashes the data on its way to the
+// real image file.
+typedef struct {
+    int pipe[2];
+    int fd;
+    int ret;
+    MD5_CTX ctx;
+    NandroidProgress* progress;
+    pthread_t thread;
+    char path[PATH_MAX];
+} NandroidChecksumTee;
+
+static void* nandroid_checksum_tee_thread(void* cookie) {
+    NandroidChecksumTee* tee = (NandroidChecksumTee*)cookie;
+    char buf[32 * 1024];
+    for (;;) {
+        ssize_t n = read(tee->pipe[0], buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n < 0)
+                tee->ret = -1;
+            break;
+        }
+        // after an error keep draining, so the writer never blocks
+        if (tee->ret != 0)
+            continue;
+        MD5_Update(&tee->ctx, buf, n);
+        nandroid_progress_add(tee->progress, n);
+        char* p = buf;
+        while (n > 0) {
+            ssize_t written = write(tee->fd, p, n);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0) {
+                tee->ret = -1;
+                break;
+            }
+            p += written;
+            n -= written;
+        }
+    }
+    return NULL;
+}
+
+static int nandroid_checksum_tee_start(NandroidChecksumTee* tee, const char* image, NandroidProgress* progress) {
+    memset(tee, 0, sizeof(*tee));
+    MD5_Init(&tee->ctx);
+    tee->progress = progress;
+    tee->fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tee->fd < 0) {
+        ui_print("Unable to create %s\n", image);
+        return -1;
+    }
+    if (pipe(tee->pipe)) {
+        close(tee->fd);
+        return -1;
+    }
+    // keep shell commands run meanwhile from holding the pipe open
+    fcntl(tee->pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(tee->pipe[1], F_SETFD, FD_CLOEXEC);
+    sprintf(tee->path, "/proc/self/fd/%d", tee->pipe[1]);
+    if (pthread_create(&tee->thread, NULL, nandroid_checksum_tee_thread, tee)) {
+        close(tee->pipe[0]);
+        close(tee->pipe[1]);
+        close(tee->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Call once the writer has closed tee->path.
+static int nandroid_checksum_tee_finish(NandroidChecksumTee* tee, NandroidChecksum* checksum, const char* image) {
+    close(tee->pipe[1]);
+    pthread_join(tee->thread, NULL);
+    close(tee->pipe[0]);
+    if (close(tee->fd))
+        tee->ret = -1;
+    if (tee->ret != 0) {
+        ui_print("Error writing %s!\n", image);
+        return tee->ret;
+    }
+    nandroid_checksum_finish(checksum, image, &tee->ctx);
+    return 0;
 }
 
 typedef void (*file_event_callback)(const char* filename);
-typedef int (*nandroid_backup_handler)(const char* backup_path, const char* backup_file_image, int callback);
+typedef int (*nandroid_backup_handler)(const char* backup_path, const char* backup_file_image, NandroidChecksum* checksum, NandroidProgress* progress);
 
-static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_file_image, NandroidChecksum* checksum, NandroidProgress* progress) {
     char backup_file_image_with_extension[PATH_MAX];
     sprintf(backup_file_image_with_extension, "%s.img", backup_file_image);
-    return mkyaffs2image(backup_path, backup_file_image_with_extension, 0, callback ? yaffs_callback : NULL);
+    NandroidChecksumTee tee;
+    if (0 != nandroid_checksum_tee_start(&tee, backup_file_image_with_extension, progress))
+        return -1;
+    int ret = mkyaffs2image(backup_path, tee.path, 0, NULL);
+    if (0 != nandroid_checksum_tee_finish(&tee, checksum, backup_file_image_with_extension) && ret == 0)
+        ret = -1;
+    return ret;
 }
 
-static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+typedef struct {
+    MD5_CTX ctx;
+    NandroidProgress* progress;
+    uint64_t bytes;             // last running total reported by tar
+} NandroidTarBackup;
+
+static void tar_backup_output(const void* data, size_t len, void* cookie) {
+    MD5_Update(&((NandroidTarBackup*)cookie)->ctx, data, len);
+}
+
+static void tar_backup_callback(const char* filename, uint64_t bytes, int files, void* cookie)
+{
+    NandroidTarBackup* backup = (NandroidTarBackup*)cookie;
+    nandroid_progress_add(backup->progress, bytes - backup->bytes);
+    backup->bytes = bytes;
+}
+
+static void tar_callback(const char* filename, uint64_t bytes, int files, void* cookie)
+{
+    yaffs_callback(filename);
+}
+
+static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, NandroidChecksum* checksum, NandroidProgress* progress) {
     char tmp[PATH_MAX];
-    if (strcmp(backup_path, "/data") == 0 && volume_for_path("/sdcard") == NULL)
-      sprintf(tmp, "cd $(dirname %s) ; tar cvf %s.tar --exclude 'media' $(basename %s) ; exit $?", backup_path, backup_file_image, backup_path);
-    else
-      sprintf(tmp, "cd $(dirname %s) ; tar cvf %s.tar $(basename %s) ; exit $?", backup_path, backup_file_image, backup_path);
+    struct stat st;
+    int flags = TAR_INDEX;
+    if (stat("/sdcard/clockworkmod/.nandroidcompress", &st) == 0)
+        flags |= TAR_GZIP;
+    sprintf(tmp, (flags & TAR_GZIP) ? "%s.tar.gz" : "%s.tar", backup_file_image);
+
+    const char* excludes[] = { "data/media", NULL };
+    const char** exclude = NULL;
+    if (nandroid_excludes_data_media(backup_path))
+        exclude = excludes;
+
+    NandroidTarBackup backup;
+    MD5_Init(&backup.ctx);
+    backup.progress = progress;
+    backup.bytes = 0;
+    int ret = tar_create(tmp, backup_path, exclude, flags, tar_backup_output, tar_backup_callback, &backup);
+    if (ret == 0)
+        nandroid_checksum_finish(checksum, tmp, &backup.ctx);
+    return ret;
+}
 
-    FILE *fp = __popen(tmp, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar.\n");
-        return -1;
+// Incremental backups keep file contents in a blob store shared by
+// every backup on the card, <card>/clockworkmod/blobs, and write only a
+// .dup manifest per partition.
+static int nandroid_is_incremental() {
+    struct stat st;
+    return stat("/sdcard/clockworkmod/.nandroidincremental", &st) == 0;
+}
+
+// Chunking lets databases and other large files that change a little
+// between backups share most of their blobs.  .nandroidcompress
+// compresses new blobs as it does tar backups.
+static int nandroid_get_dedupe_flags() {
+    struct stat st;
+    int flags = 0;
+    if (stat("/sdcard/clockworkmod/.nandroidchunk", &st) == 0)
+        flags |= DEDUPE_CHUNK;
+    if (stat("/sdcard/clockworkmod/.nandroidcompress", &st) == 0)
+        flags |= DEDUPE_COMPRESS;
+    return flags;
+}
+
+// image is a file in a backup directory, <card>/clockworkmod/backup/<name>.
+static void nandroid_get_blob_dir(const char* image, char* blob_dir) {
+    char tmp[PATH_MAX];
+    strcpy(tmp, image);
+    int i;
+    for (i = 0; i < 3; i++) {
+        char* slash = strrchr(tmp, '/');
+        if (slash != NULL)
+            *slash = '\0';
     }
+    sprintf(blob_dir, "%s/blobs", tmp);
+}
+
+typedef struct {
+    NandroidProgress* progress;
+    uint64_t bytes;             // last running total reported by dedupe
+} NandroidDedupeBackup;
 
-    while (fgets(tmp, PATH_MAX, fp) != NULL) {
-        tmp[PATH_MAX - 1] = NULL;
-        if (callback)
-            yaffs_callback(tmp);
+static void dedupe_backup_callback(const char* path, uint64_t bytes, void* cookie)
+{
+    NandroidDedupeBackup* backup = (NandroidDedupeBackup*)cookie;
+    nandroid_progress_add(backup->progress, bytes - backup->bytes);
+    backup->bytes = bytes;
+}
+
+static int dedupe_compress_wrapper(const char* backup_path, const char* backup_file_image, NandroidChecksum* checksum, NandroidProgress* progress) {
+    char tmp[PATH_MAX];
+    char blob_dir[PATH_MAX];
+    sprintf(tmp, "%s.dup", backup_file_image);
+    nandroid_get_blob_dir(tmp, blob_dir);
+    if (0 != dirCreateHierarchy(blob_dir, 0777, NULL, false)) {
+        ui_print("Unable to create %s\n", blob_dir);
+        return -1;
     }
 
-    return __pclose(fp);
+    const char* excludes[] = { "media", NULL };
+    const char** exclude = NULL;
+    if (nandroid_excludes_data_media(backup_path))
+        exclude = excludes;
+
+    NandroidDedupeBackup backup;
+    backup.progress = progress;
+    backup.bytes = 0;
+    int ret = dedupe_store(backup_path, blob_dir, tmp, exclude, nandroid_get_dedupe_flags(), 0, dedupe_backup_callback, &backup);
+    // the manifest is small; the blobs are named by their own hash
+    if (ret == 0 && 0 != (ret = nandroid_checksum_file(checksum, tmp)))
+        ui_print("Error reading %s\n", tmp);
+    return ret;
 }
 
 static nandroid_backup_handler get_backup_handler(const char *backup_path) {
@@ -140,6 +491,10 @@ static nandroid_backup_handler get_backup_handler(const char *backup_path) {
         return NULL;
     }
 
+    if (nandroid_is_incremental()) {
+        return dedupe_compress_wrapper;
+    }
+
     if (strcmp(backup_path, "/data") == 0 && is_data_media()) {
         return tar_compress_wrapper;
     }
@@ -160,46 +515,92 @@ static nandroid_backup_handler get_backup_handler(const char *backup_path) {
 }
 
 
-int nandroid_backup_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
+typedef struct {
+    char name[PATH_MAX];            // basename() reuses one buffer
+    const char* mount_point;        // NULL for raw partitions
+    const char* fs_type;            // raw partitions only
+    const char* device;             // raw partitions only
+    char image[PATH_MAX];
+    nandroid_backup_handler handler;
+    int umount_when_finished;
+    NandroidChecksum checksum;
+    NandroidProgress progress;
+} NandroidBackupJob;
+
+#define NANDROID_MAX_BACKUP_JOBS 16
+
+typedef struct {
+    NandroidBackupJob jobs[NANDROID_MAX_BACKUP_JOBS];
+    int num_jobs;
+    int next_job;
+    int ret;
+    pthread_mutex_t mutex;
+} NandroidBackupQueue;
+
+// mkyaffs2image and the mtd/mmc partition scanners keep global state,
+// so jobs that use them never run at the same time.
+static pthread_mutex_t yaffs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t raw_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static NandroidBackupJob* nandroid_add_backup_job(NandroidBackupQueue* queue, const char* name) {
+    if (queue->num_jobs == NANDROID_MAX_BACKUP_JOBS) {
+        ui_print("Too many partitions to back up!\n");
+        return NULL;
+    }
+    NandroidBackupJob* job = &queue->jobs[queue->num_jobs++];
+    memset(job, 0, sizeof(*job));
+    strlcpy(job->name, name, sizeof(job->name));
+    return job;
+}
+
+static int nandroid_queue_raw_backup(NandroidBackupQueue* queue, const char* name, Volume* vol, const char* image) {
+    NandroidBackupJob* job = nandroid_add_backup_job(queue, name);
+    if (job == NULL)
+        return -1;
+    job->fs_type = vol->fs_type;
+    job->device = vol->device;
+    strcpy(job->image, image);
+    // the partition size isn't known; the bytes count as they come
+    nandroid_progress_expect(&job->progress, 0);
+    return 0;
+}
+
+// Mounting, sizing and picking the backup handler all touch
+// global state, so they happen here on the main thread before any
+// worker starts.
+int nandroid_queue_partition_backup_extended(NandroidBackupQueue* queue, const char* backup_path, const char* mount_point, int umount_when_finished) {
     int ret = 0;
     char* name = basename(mount_point);
 
-    struct stat file_info;
-    int callback = stat("/sdcard/clockworkmod/.hidenandroidprogress", &file_info) != 0;
-    
-    ui_print("Backing up %s...\n", name);
     if (0 != (ret = ensure_path_mounted(mount_point) != 0)) {
         ui_print("Can't mount %s!\n", mount_point);
         return ret;
     }
-    compute_directory_stats(mount_point);
-    char tmp[PATH_MAX];
+    NandroidBackupJob* job = nandroid_add_backup_job(queue, name);
+    if (job == NULL)
+        return -1;
+    job->mount_point = mount_point;
+    job->umount_when_finished = umount_when_finished;
+
     scan_mounted_volumes();
     Volume *v = volume_for_path(mount_point);
     MountedVolume *mv = NULL;
     if (v != NULL)
         mv = find_mounted_volume_by_mount_point(v->mount_point);
     if (mv == NULL || mv->filesystem == NULL)
-        sprintf(tmp, "%s/%s.auto", backup_path, name);
+        sprintf(job->image, "%s/%s.auto", backup_path, name);
     else
-        sprintf(tmp, "%s/%s.%s", backup_path, name, mv->filesystem);
-    nandroid_backup_handler backup_handler = get_backup_handler(mount_point);
-    if (backup_handler == NULL) {
+        sprintf(job->image, "%s/%s.%s", backup_path, name, mv->filesystem);
+    job->handler = get_backup_handler(mount_point);
+    if (job->handler == NULL) {
         ui_print("Error finding an appropriate backup handler.\n");
         return -2;
     }
-    ret = backup_handler(mount_point, tmp, callback);
-    if (umount_when_finished) {
-        ensure_path_unmounted(mount_point);
-    }
-    if (0 != ret) {
-        ui_print("Error while making a backup image of %s!\n", mount_point);
-        return ret;
-    }
+    nandroid_progress_expect(&job->progress, nandroid_estimate_backup_size(mount_point, job->handler == mkyaffs2image_wrapper));
     return 0;
 }
 
-int nandroid_backup_partition(const char* backup_path, const char* root) {
+int nandroid_queue_partition_backup(NandroidBackupQueue* queue, const char* backup_path, const char* root) {
     Volume *vol = volume_for_path(root);
     // make sure the volume exists before attempting anything...
     if (vol == NULL || vol->fs_type == NULL)
@@ -207,21 +608,157 @@ int nandroid_backup_partition(const char* backup_path, const char* root) {
 
     // see if we need a raw backup (mtd)
     char tmp[PATH_MAX];
-    int ret;
     if (strcmp(vol->fs_type, "mtd") == 0 ||
             strcmp(vol->fs_type, "bml") == 0 ||
             strcmp(vol->fs_type, "emmc") == 0) {
         const char* name = basename(root);
         sprintf(tmp, "%s/%s.img", backup_path, name);
-        ui_print("Backing up %s image...\n", name);
-        if (0 != (ret = backup_raw_partition(vol->fs_type, vol->device, tmp))) {
-            ui_print("Error while backing up %s image!", name);
+        return nandroid_queue_raw_backup(queue, name, vol, tmp);
+    }
+
+    return nandroid_queue_partition_backup_extended(queue, backup_path, root, 1);
+}
+
+static int nandroid_run_backup_job(NandroidBackupQueue* queue, NandroidBackupJob* job) {
+    int ret;
+    if (job->mount_point == NULL) {
+        ui_print("Backing up %s image...\n", job->name);
+        NandroidChecksumTee tee;
+        if (0 != (ret = nandroid_checksum_tee_start(&tee, job->image, &job->progress)))
+            return ret;
+        pthread_mutex_lock(&raw_mutex);
+        ret = backup_raw_partition_sparse(job->fs_type, job->device, tee.path);
+        pthread_mutex_unlock(&raw_mutex);
+        if (0 != nandroid_checksum_tee_finish(&tee, &job->checksum, job->image) && ret == 0)
+            ret = -1;
+        if (0 != ret) {
+            ui_print("Error while backing up %s image!\n", job->name);
             return ret;
         }
+        nandroid_progress_finish(&job->progress);
         return 0;
     }
 
-    return nandroid_backup_partition_extended(backup_path, root, 1);
+    ui_print("Backing up %s...\n", job->name);
+    int serialize = job->handler == mkyaffs2image_wrapper;
+    if (serialize)
+        pthread_mutex_lock(&yaffs_mutex);
+    ret = job->handler(job->mount_point, job->image, &job->checksum, &job->progress);
+    if (serialize)
+        pthread_mutex_unlock(&yaffs_mutex);
+    if (0 != ret) {
+        ui_print("Error while making a backup image of %s!\n", job->mount_point);
+        return ret;
+    }
+    nandroid_progress_finish(&job->progress);
+    return 0;
+}
+
+static void* nandroid_backup_worker(void* cookie) {
+    NandroidBackupQueue* queue = (NandroidBackupQueue*)cookie;
+    for (;;) {
+        NandroidBackupJob* job = NULL;
+        pthread_mutex_lock(&queue->mutex);
+        // stop handing out work once any partition has failed
+        if (queue->ret == 0 && queue->next_job < queue->num_jobs)
+            job = &queue->jobs[queue->next_job++];
+        pthread_mutex_unlock(&queue->mutex);
+        if (job == NULL)
+            break;
+
+        int ret = nandroid_run_backup_job(queue, job);
+        if (0 != ret) {
+            pthread_mutex_lock(&queue->mutex);
+            if (queue->ret == 0)
+                queue->ret = ret;
+            pthread_mutex_unlock(&queue->mutex);
+        }
+    }
+    return NULL;
+}
+
+static int nandroid_get_threads(const char* property) {
+    char value[PROPERTY_VALUE_MAX];
+    property_get(property, value, "2");
+    int threads = atoi(value);
+    if (threads < 1)
+        threads = 1;
+    if (threads > NANDROID_MAX_BACKUP_JOBS)
+        threads = NANDROID_MAX_BACKUP_JOBS;
+    return threads;
+}
+
+static void nandroid_unmount_backup_jobs(NandroidBackupQueue* queue) {
+    int i;
+    for (i = 0; i < queue->num_jobs; i++) {
+        if (queue->jobs[i].umount_when_finished)
+            ensure_path_unmounted(queue->jobs[i].mount_point);
+    }
+}
+
+// Back up every queued partition, running up to ro.cwm.backup_threads
+// of them at once.  Each partition writes its own image, so partitions
+// on different devices proceed in parallel.
+static int nandroid_run_backup_queue(NandroidBackupQueue* queue) {
+    pthread_t threads[NANDROID_MAX_BACKUP_JOBS];
+    int num_threads = nandroid_get_threads("ro.cwm.backup_threads");
+    if (num_threads > queue->num_jobs)
+        num_threads = queue->num_jobs;
+
+    ui_reset_progress();
+    ui_show_progress(1, 0);
+
+    int i;
+    int started = 0;
+    for (i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[started], NULL, nandroid_backup_worker, queue) == 0)
+            started++;
+    }
+    // the calling thread is a worker too
+    nandroid_backup_worker(queue);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    nandroid_unmount_backup_jobs(queue);
+    return queue->ret;
+}
+
+static const char* nandroid_checksum_name(const NandroidChecksum* checksum) {
+    const char* slash = strrchr(checksum->filename, '/');
+    return slash == NULL ? checksum->filename : slash + 1;
+}
+
+// Sort like the shell expands "* .*", which is how nandroid.md5 used
+// to be generated.
+static int nandroid_compare_checksums(const void* a, const void* b) {
+    // not basename(), which hands both calls the same buffer on bionic
+    const char* name_a = nandroid_checksum_name(*(NandroidChecksum**)a);
+    const char* name_b = nandroid_checksum_name(*(NandroidChecksum**)b);
+    if ((name_a[0] == '.') != (name_b[0] == '.'))
+        return name_a[0] == '.' ? 1 : -1;
+    return strcmp(name_a, name_b);
+}
+
+// Write the checksums gathered during the backup in md5sum format, so
+// that "md5sum -c nandroid.md5" keeps working.
+static int nandroid_write_checksums(NandroidBackupQueue* queue, const char* backup_path) {
+    NandroidChecksum* checksums[NANDROID_MAX_BACKUP_JOBS];
+    int count = 0;
+    int i;
+    for (i = 0; i < queue->num_jobs; i++) {
+        if (queue->jobs[i].checksum.filename[0] != '\0')
+            checksums[count++] = &queue->jobs[i].checksum;
+    }
+    qsort(checksums, count, sizeof(checksums[0]), nandroid_compare_checksums);
+
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s/nandroid.md5", backup_path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL)
+        return -1;
+    for (i = 0; i < count; i++)
+        fprintf(f, "%s  %s\n", checksums[i]->md5, nandroid_checksum_name(checksums[i]));
+    return fclose(f);
 }
 
 int nandroid_backup(const char* backup_path)
@@ -251,34 +788,37 @@ int nandroid_backup(const char* backup_path)
     sprintf(tmp, "mkdir -p %s", backup_path);
     __system(tmp);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/boot")))
-        return ret;
+    NandroidBackupQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.mutex, NULL);
+    nandroid_progress_reset(stat("/sdcard/clockworkmod/.hidenandroidprogress", &s) != 0);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/recovery")))
-        return ret;
+    if (0 != (ret = nandroid_queue_partition_backup(&queue, backup_path, "/boot")))
+        goto fail;
+
+    if (0 != (ret = nandroid_queue_partition_backup(&queue, backup_path, "/recovery")))
+        goto fail;
 
     Volume *vol = volume_for_path("/wimax");
     if (vol != NULL && 0 == stat(vol->device, &s))
     {
         char serialno[PROPERTY_VALUE_MAX];
-        ui_print("Backing up WiMAX...\n");
         serialno[0] = 0;
         property_get("ro.serialno", serialno, "");
         sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
-        ret = backup_raw_partition(vol->fs_type, vol->device, tmp);
-        if (0 != ret)
-            return print_and_error("Error while dumping WiMAX image!\n");
+        if (0 != (ret = nandroid_queue_raw_backup(&queue, "WiMAX", vol, tmp)))
+            goto fail;
     }
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/system")))
-        return ret;
+    if (0 != (ret = nandroid_queue_partition_backup(&queue, backup_path, "/system")))
+        goto fail;
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/data")))
-        return ret;
+    if (0 != (ret = nandroid_queue_partition_backup(&queue, backup_path, "/data")))
+        goto fail;
 
     if (has_datadata()) {
-        if (0 != (ret = nandroid_backup_partition(backup_path, "/datadata")))
-            return ret;
+        if (0 != (ret = nandroid_queue_partition_backup(&queue, backup_path, "/datadata")))
+            goto fail;
     }
 
     if (0 != stat("/sdcard/.android_secure", &s))
@@ -287,12 +827,12 @@ int nandroid_backup(const char* backup_path)
     }
     else
     {
-        if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/sdcard/.android_secure", 0)))
-            return ret;
+        if (0 != (ret = nandroid_queue_partition_backup_extended(&queue, backup_path, "/sdcard/.android_secure", 0)))
+            goto fail;
     }
 
-    if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/cache", 0)))
-        return ret;
+    if (0 != (ret = nandroid_queue_partition_backup_extended(&queue, backup_path, "/cache", 0)))
+        goto fail;
 
     vol = volume_for_path("/sd-ext");
     if (vol == NULL || 0 != stat(vol->device, &s))
@@ -303,13 +843,15 @@ int nandroid_backup(const char* backup_path)
     {
         if (0 != ensure_path_mounted("/sd-ext"))
             ui_print("Could not mount sd-ext. sd-ext backup may not be supported on this device. Skipping backup of sd-ext.\n");
-        else if (0 != (ret = nandroid_backup_partition(backup_path, "/sd-ext")))
-            return ret;
+        else if (0 != (ret = nandroid_queue_partition_backup(&queue, backup_path, "/sd-ext")))
+            goto fail;
     }
 
+    if (0 != (ret = nandroid_run_backup_queue(&queue)))
+        return ret;
+
     ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
+    if (0 != (ret = nandroid_write_checksums(&queue, backup_path))) {
         ui_print("Error while generating md5 sum!\n");
         return ret;
     }
@@ -319,6 +861,10 @@ int nandroid_backup(const char* backup_path)
     ui_reset_progress();
     ui_print("\nBackup complete!\n");
     return 0;
+
+fail:
+    nandroid_unmount_backup_jobs(&queue);
+    return ret;
 }
 
 typedef int (*format_function)(char* root);
@@ -335,23 +881,41 @@ static int unyaffs_wrapper(const char* backup_file_image, const char* backup_pat
     return unyaffs(backup_file_image, backup_path, callback ? yaffs_callback : NULL);
 }
 
+// Delta restores bring the partition up to date in place instead of
+// formatting it, so only the files that changed since the backup are
+// written.  .nandroiddeltaverify compares file contents as well.
+static int nandroid_get_delta_flags() {
+    struct stat st;
+    if (stat("/sdcard/clockworkmod/.nandroiddelta", &st) != 0)
+        return 0;
+    if (stat("/sdcard/clockworkmod/.nandroiddeltaverify", &st) == 0)
+        return TAR_DELTA | TAR_DELTA_CONTENT;
+    return TAR_DELTA;
+}
+
 static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    // the archive entries are relative to the parent of the mount point
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; tar xvf %s ; exit $?", backup_path, backup_file_image);
+    strcpy(tmp, backup_path);
 
-    char path[PATH_MAX];
-    FILE *fp = __popen(tmp, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar.\n");
-        return -1;
-    }
+    // never delete the internal sdcard while bringing /data up to date
+    const char* excludes[] = { "data/media", NULL };
+    const char** exclude = NULL;
+    if (strcmp(backup_path, "/data") == 0 && volume_for_path("/sdcard") == NULL)
+        exclude = excludes;
 
-    while (fgets(path, PATH_MAX, fp) != NULL) {
-        if (callback)
-            yaffs_callback(path);
-    }
+    return tar_extract(backup_file_image, dirname(tmp), exclude, nandroid_get_delta_flags(), callback ? tar_callback : NULL, NULL);
+}
 
-    return __pclose(fp);
+static void dedupe_restore_callback(const char* path, uint64_t bytes, void* cookie)
+{
+    yaffs_callback(path);
+}
+
+static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    char blob_dir[PATH_MAX];
+    nandroid_get_blob_dir(backup_file_image, blob_dir);
+    return dedupe_extract(backup_file_image, blob_dir, backup_path, 0, callback ? dedupe_restore_callback : NULL, NULL);
 }
 
 static nandroid_restore_handler get_restore_handler(const char *backup_path) {
@@ -386,6 +950,241 @@ static nandroid_restore_handler get_restore_handler(const char *backup_path) {
     return tar_extract_wrapper;
 }
 
+// nandroid.md5 is checked natively.  The listed images are hashed on
+// ro.cwm.verify_threads threads while the restore proceeds, and every
+// partition waits only for its own image before it is formatted.
+enum {
+    VERIFY_PENDING,
+    VERIFY_RUNNING,
+    VERIFY_OK,
+    VERIFY_FAILED,
+};
+
+typedef struct {
+    char name[PATH_MAX];
+    char md5[MD5_DIGEST_LENGTH * 2 + 1];
+    uint64_t size;
+    int status;
+} NandroidVerifyEntry;
+
+typedef struct {
+    const char* backup_path;
+    NandroidVerifyEntry* entries;
+    int num_entries;
+    int cancelled;
+    uint64_t bytes_total;
+    uint64_t bytes_done;
+    pthread_t threads[NANDROID_MAX_BACKUP_JOBS];
+    int num_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} NandroidVerifier;
+
+static NandroidVerifier* restore_verifier = NULL;
+
+static int nandroid_load_checksums(NandroidVerifier* verifier) {
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s/nandroid.md5", verifier->backup_path);
+    FILE* f = fopen(tmp, "r");
+    if (f == NULL) {
+        ui_print("Unable to open %s\n", tmp);
+        return -1;
+    }
+
+    int ret = 0;
+    int capacity = 0;
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        int len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        // "<md5>  <name>", or "<md5> *<name>" for binary mode
+        if (len < 35 || line[32] != ' ' || (line[33] != ' ' && line[33] != '*')) {
+            ui_print("Malformed line in nandroid.md5\n");
+            ret = -1;
+            break;
+        }
+        if (verifier->num_entries == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            NandroidVerifyEntry* entries = realloc(verifier->entries, capacity * sizeof(NandroidVerifyEntry));
+            if (entries == NULL) {
+                ret = -1;
+                break;
+            }
+            verifier->entries = entries;
+        }
+        NandroidVerifyEntry* entry = &verifier->entries[verifier->num_entries++];
+        memset(entry, 0, sizeof(*entry));
+        memcpy(entry->md5, line, 32);
+        strncpy(entry->name, line + 34, sizeof(entry->name) - 1);
+
+        struct stat st;
+        sprintf(tmp, "%s/%s", verifier->backup_path, entry->name);
+        if (stat(tmp, &st) == 0) {
+            entry->size = st.st_size;
+            verifier->bytes_total += st.st_size;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+static int nandroid_hash_entry(NandroidVerifier* verifier, NandroidVerifyEntry* entry) {
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s/%s", verifier->backup_path, entry->name);
+    int fd = open(tmp, O_RDONLY);
+    if (fd < 0) {
+        ui_print("%s: FAILED open or read\n", entry->name);
+        return VERIFY_FAILED;
+    }
+
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    char buf[64 * 1024];
+    ssize_t n;
+    int cancelled = 0;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        MD5_Update(&ctx, buf, n);
+
+        pthread_mutex_lock(&verifier->mutex);
+        verifier->bytes_done += n;
+        cancelled = verifier->cancelled;
+        float fraction = verifier->bytes_total == 0 ? 0 :
+                (float)verifier->bytes_done / (float)verifier->bytes_total;
+        pthread_mutex_unlock(&verifier->mutex);
+        if (cancelled)
+            break;
+        ui_set_progress(fraction);
+    }
+    close(fd);
+    if (n != 0) {
+        if (!cancelled)
+            ui_print("%s: FAILED open or read\n", entry->name);
+        return VERIFY_FAILED;
+    }
+
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char md5[MD5_DIGEST_LENGTH * 2 + 1];
+    MD5_Final(digest, &ctx);
+    int i;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(md5 + 2 * i, "%02x", digest[i]);
+    if (strcasecmp(md5, entry->md5) != 0) {
+        ui_print("%s: FAILED\n", entry->name);
+        return VERIFY_FAILED;
+    }
+    ui_print("%s: OK\n", entry->name);
+    return VERIFY_OK;
+}
+
+// Hash entry (claimed by the caller) and publish the result.
+static void nandroid_run_verify_entry(NandroidVerifier* verifier, NandroidVerifyEntry* entry) {
+    int status = nandroid_hash_entry(verifier, entry);
+    pthread_mutex_lock(&verifier->mutex);
+    entry->status = status;
+    pthread_cond_broadcast(&verifier->cond);
+    pthread_mutex_unlock(&verifier->mutex);
+}
+
+static void* nandroid_verify_worker(void* cookie) {
+    NandroidVerifier* verifier = (NandroidVerifier*)cookie;
+    for (;;) {
+        NandroidVerifyEntry* entry = NULL;
+        pthread_mutex_lock(&verifier->mutex);
+        int i;
+        for (i = 0; !verifier->cancelled && i < verifier->num_entries; i++) {
+            if (verifier->entries[i].status == VERIFY_PENDING) {
+                entry = &verifier->entries[i];
+                entry->status = VERIFY_RUNNING;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&verifier->mutex);
+        if (entry == NULL)
+            break;
+        nandroid_run_verify_entry(verifier, entry);
+    }
+    return NULL;
+}
+
+static NandroidVerifier* nandroid_start_verifier(const char* backup_path) {
+    NandroidVerifier* verifier = calloc(1, sizeof(NandroidVerifier));
+    if (verifier == NULL)
+        return NULL;
+    verifier->backup_path = backup_path;
+    pthread_mutex_init(&verifier->mutex, NULL);
+    pthread_cond_init(&verifier->cond, NULL);
+    if (0 != nandroid_load_checksums(verifier)) {
+        free(verifier->entries);
+        free(verifier);
+        return NULL;
+    }
+
+    ui_show_progress(1, 0);
+    int num_threads = nandroid_get_threads("ro.cwm.verify_threads");
+    int i;
+    for (i = 0; i < num_threads && i < verifier->num_entries; i++) {
+        if (pthread_create(&verifier->threads[verifier->num_threads], NULL, nandroid_verify_worker, verifier) == 0)
+            verifier->num_threads++;
+    }
+    return verifier;
+}
+
+static void nandroid_stop_verifier(NandroidVerifier* verifier) {
+    pthread_mutex_lock(&verifier->mutex);
+    verifier->cancelled = 1;
+    pthread_mutex_unlock(&verifier->mutex);
+    int i;
+    for (i = 0; i < verifier->num_threads; i++)
+        pthread_join(verifier->threads[i], NULL);
+    pthread_mutex_destroy(&verifier->mutex);
+    pthread_cond_destroy(&verifier->cond);
+    free(verifier->entries);
+    free(verifier);
+}
+
+// Wait until image has been checked against nandroid.md5, hashing it
+// on this thread if no worker has got to it yet.  Images that are not
+// listed are not checked, just like "md5sum -c".
+static int nandroid_verify_image(const char* image) {
+    NandroidVerifier* verifier = restore_verifier;
+    if (verifier == NULL)
+        return 0;
+    const char* name = basename(image);
+    NandroidVerifyEntry* entry = NULL;
+    int i;
+    for (i = 0; i < verifier->num_entries; i++) {
+        if (strcmp(verifier->entries[i].name, name) == 0) {
+            entry = &verifier->entries[i];
+            break;
+        }
+    }
+    if (entry == NULL)
+        return 0;
+
+    pthread_mutex_lock(&verifier->mutex);
+    if (entry->status == VERIFY_PENDING) {
+        entry->status = VERIFY_RUNNING;
+        pthread_mutex_unlock(&verifier->mutex);
+        nandroid_run_verify_entry(verifier, entry);
+        pthread_mutex_lock(&verifier->mutex);
+    }
+    while (entry->status == VERIFY_RUNNING)
+        pthread_cond_wait(&verifier->cond, &verifier->mutex);
+    int status = entry->status;
+    pthread_mutex_unlock(&verifier->mutex);
+    if (status != VERIFY_OK)
+        return print_and_error("MD5 mismatch!\n");
+    return 0;
+}
+
 int nandroid_restore_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
     int ret = 0;
     char* name = basename(mount_point);
@@ -420,6 +1219,18 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
                 restore_handler = tar_extract_wrapper;
                 break;
             }
+            sprintf(tmp, "%s/%s.%s.tar.gz", backup_path, name, filesystem);
+            if (0 == (ret = statfs(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = tar_extract_wrapper;
+                break;
+            }
+            sprintf(tmp, "%s/%s.%s.dup", backup_path, name, filesystem);
+            if (0 == (ret = statfs(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = dedupe_extract_wrapper;
+                break;
+            }
             i++;
         }
 
@@ -443,12 +1254,18 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
             backup_filesystem = NULL;
     }
 
+    if (0 != (ret = nandroid_verify_image(tmp)))
+        return ret;
+
     ensure_directory(mount_point);
 
     int callback = stat("/sdcard/clockworkmod/.hidenandroidprogress", &file_info) != 0;
 
     ui_print("Restoring %s...\n", name);
-    if (backup_filesystem == NULL) {
+    if (restore_handler == tar_extract_wrapper && nandroid_get_delta_flags() != 0) {
+        ui_print("Updating %s in place...\n", name);
+    }
+    else if (backup_filesystem == NULL) {
         if (0 != (ret = format_volume(mount_point))) {
             ui_print("Error while formatting %s!\n", mount_point);
             return ret;
@@ -495,12 +1312,14 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
             strcmp(vol->fs_type, "emmc") == 0) {
         int ret;
         const char* name = basename(root);
+        sprintf(tmp, "%s%s.img", backup_path, root);
+        if (0 != (ret = nandroid_verify_image(tmp)))
+            return ret;
         ui_print("Erasing %s before restore...\n", name);
         if (0 != (ret = format_volume(root))) {
             ui_print("Error while erasing %s image!", name);
             return ret;
         }
-        sprintf(tmp, "%s%s.img", backup_path, root);
         ui_print("Restoring %s image...\n", name);
         if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, tmp))) {
             ui_print("Error while flashing %s image!", name);
@@ -511,22 +1330,9 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
     return nandroid_restore_partition_extended(backup_path, root, 1);
 }
 
-int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
+static int nandroid_restore_partitions(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
 {
-    ui_set_background(BACKGROUND_ICON_INSTALLING);
-    ui_show_indeterminate_progress();
-    yaffs_files_total = 0;
-
-    if (ensure_path_mounted(backup_path) != 0)
-        return print_and_error("Can't mount backup path\n");
-    
     char tmp[PATH_MAX];
-
-    ui_print("Checking MD5 sums...\n");
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
-        return print_and_error("MD5 mismatch!\n");
-    
     int ret;
 
     if (restore_boot && NULL != volume_for_path("/boot") && 0 != (ret = nandroid_restore_partition(backup_path, "/boot")))
@@ -552,6 +1358,8 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
         }
         else
         {
+            if (0 != (ret = nandroid_verify_image(tmp)))
+                return ret;
             ui_print("Erasing WiMAX before restore...\n");
             if (0 != (ret = format_volume("/wimax")))
                 return print_and_error("Error while formatting wimax!\n");
@@ -581,6 +1389,28 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     if (restore_sdext && 0 != (ret = nandroid_restore_partition(backup_path, "/sd-ext")))
         return ret;
 
+    return 0;
+}
+
+int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
+{
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+
+    if (ensure_path_mounted(backup_path) != 0)
+        return print_and_error("Can't mount backup path\n");
+
+    ui_print("Checking MD5 sums...\n");
+    restore_verifier = nandroid_start_verifier(backup_path);
+    if (restore_verifier == NULL)
+        return print_and_error("MD5 mismatch!\n");
+
+    int ret = nandroid_restore_partitions(backup_path, restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+    nandroid_stop_verifier(restore_verifier);
+    restore_verifier = NULL;
+    if (0 != ret)
+        return ret;
+
     sync();
     ui_set_background(BACKGROUND_ICON_NONE);
     ui_reset_progress();
@@ -588,15 +1418,102 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     return 0;
 }
 
+// Single files can be restored from tar backups.  mount_point/foo is
+// the archive entry <name of mount_point>/foo.
+int nandroid_find_tar_image(const char* backup_path, const char* mount_point, char* image) {
+    const char *filesystems[] = { "yaffs2", "ext2", "ext3", "ext4", "vfat", "rfs", NULL };
+    const char* name = strrchr(mount_point, '/');
+    name = name == NULL ? mount_point : name + 1;
+    struct stat st;
+    int i;
+    for (i = 0; filesystems[i] != NULL; i++) {
+        sprintf(image, "%s/%s.%s.tar", backup_path, name, filesystems[i]);
+        if (0 == stat(image, &st))
+            return 0;
+        sprintf(image, "%s/%s.%s.tar.gz", backup_path, name, filesystems[i]);
+        if (0 == stat(image, &st))
+            return 0;
+    }
+    return -1;
+}
+
+int nandroid_restore_files(const char* backup_path, const char* mount_point, const char** paths) {
+    char image[PATH_MAX];
+    if (0 != nandroid_find_tar_image(backup_path, mount_point, image)) {
+        ui_print("No tar backup of %s found.\n", mount_point);
+        return 1;
+    }
+    if (0 != ensure_path_mounted(mount_point)) {
+        ui_print("Can't mount %s!\n", mount_point);
+        return 1;
+    }
+
+    struct stat st;
+    int callback = stat("/sdcard/clockworkmod/.hidenandroidprogress", &st) != 0;
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+    ui_print("Restoring from %s...\n", image);
+
+    // the archive entries are relative to the parent of the mount point
+    char tmp[PATH_MAX];
+    strcpy(tmp, mount_point);
+    int ret = tar_extract_paths(image, dirname(tmp), paths, callback ? tar_callback : NULL, NULL);
+    sync();
+    ui_set_background(BACKGROUND_ICON_NONE);
+    ui_reset_progress();
+    if (ret != 0)
+        return print_and_error("Error while restoring files!\n");
+    ui_print("\nRestore complete!\n");
+    return 0;
+}
+
+static void nandroid_list_callback(const char* name, uint64_t size, void* cookie) {
+    printf("%12llu  %s\n", (unsigned long long)size, name);
+}
+
 int nandroid_usage()
 {
     printf("Usage: nandroid backup\n");
     printf("Usage: nandroid restore <directory>\n");
+    printf("Usage: nandroid list <directory> <partition>\n");
+    printf("Usage: nandroid extract <directory> <path>...\n");
     return 1;
 }
 
 int nandroid_main(int argc, char** argv)
 {
+    if (argc >= 3 && strcmp("list", argv[1]) == 0)
+    {
+        if (argc != 4)
+            return nandroid_usage();
+        char image[PATH_MAX];
+        if (0 != nandroid_find_tar_image(argv[2], argv[3], image)) {
+            printf("No tar backup of %s found.\n", argv[3]);
+            return 1;
+        }
+        return tar_list(image, nandroid_list_callback, NULL);
+    }
+
+    if (argc >= 3 && strcmp("extract", argv[1]) == 0)
+    {
+        if (argc < 4)
+            return nandroid_usage();
+        // each path names its partition, eg /data/system/accounts.db
+        int i;
+        for (i = 3; i < argc; i++) {
+            char mount_point[PATH_MAX];
+            const char* path = argv[i];
+            while (*path == '/')
+                path++;
+            snprintf(mount_point, sizeof(mount_point), "/%.*s", (int)strcspn(path, "/"), path);
+            const char* paths[] = { path, NULL };
+            int ret = nandroid_restore_files(argv[2], mount_point, paths);
+            if (ret != 0)
+                return ret;
+        }
+        return 0;
+    }
+
     if (argc > 3 || argc < 2)
         return nandroid_usage();
     
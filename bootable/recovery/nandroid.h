@@ -4,5 +4,7 @@
 int nandroid_main(int argc, char** argv);
 int nandroid_backup(const char* backup_path);
 int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax);
+int nandroid_find_tar_image(const char* backup_path, const char* mount_point, char* image);
+int nandroid_restore_files(const char* backup_path, const char* mount_point, const char** paths);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,576 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zlib.h"
+#include "blockgz.h"
+
+// Cards write slower than even a single core deflates at this level.
+#define BLOCKGZ_LEVEL       3
+#define BLOCKGZ_MAX_THREADS 8
+#define BLOCKGZ_STREAM_BUFFER_SIZE (64 * 1024)
+
+// Every member starts with a fixed header: magic, CM (deflate),
+// FLG (FEXTRA only), MTIME, XFL, OS, XLEN and one "NB" subfield that
+// holds the length of the whole member.
+#define GZ_HEADER_SIZE      20
+#define GZ_TRAILER_SIZE     8
+#define GZ_FEXTRA           4
+#define GZ_ID1              0x1f
+#define GZ_ID2              0x8b
+#define GZ_CM_DEFLATE       8
+#define GZ_OS_UNIX          3
+#define BLOCKGZ_SI1         'N'
+#define BLOCKGZ_SI2         'B'
+
+enum { SLOT_FREE, SLOT_QUEUED, SLOT_DONE };
+
+typedef struct {
+    unsigned char *in;
+    size_t in_len;
+    size_t in_cap;
+    unsigned char *out;
+    size_t out_len;
+    size_t out_cap;
+    int state;
+    int error;
+} BlockGzSlot;
+
+struct BlockGz {
+    int fd;
+    int writing;
+    int error;
+    blockgz_output_callback output;
+    void *cookie;
+
+    // Block n lives in slots[n % num_slots].
+    BlockGzSlot *slots;
+    int num_slots;
+    long next_queue;    // next block to hand to the workers
+    long next_work;     // next block a worker picks up
+    long next_done;     // oldest block not yet written out or consumed
+
+    pthread_t threads[BLOCKGZ_MAX_THREADS];
+    int num_threads;
+    int shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    // reader only
+    size_t out_pos;
+    int input_done;
+    int streaming;      // foreign gzip file, inflated on this thread
+    int member_done;
+    z_stream stream;
+    unsigned char *stream_buf;
+};
+
+static void put2(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put4(unsigned char *p, uint32_t v)
+{
+    put2(p, v & 0xffff);
+    put2(p + 2, v >> 16);
+}
+
+static unsigned int get2(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get4(const unsigned char *p)
+{
+    return get2(p) | ((uint32_t)get2(p + 2) << 16);
+}
+
+static int write_fully(int fd, const unsigned char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Returns the number of bytes read, short only at end of file.
+static ssize_t read_fully(int fd, unsigned char *data, size_t len)
+{
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = read(fd, data + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+static int ensure_capacity(unsigned char **buf, size_t *cap, size_t len)
+{
+    if (*cap >= len)
+        return 0;
+    unsigned char *p = (unsigned char *)realloc(*buf, len);
+    if (p == NULL)
+        return -1;
+    *buf = p;
+    *cap = len;
+    return 0;
+}
+
+static int deflate_block(BlockGzSlot *slot)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, BLOCKGZ_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    size_t need = GZ_HEADER_SIZE + deflateBound(&z, slot->in_len) + GZ_TRAILER_SIZE;
+    if (ensure_capacity(&slot->out, &slot->out_cap, need)) {
+        deflateEnd(&z);
+        return -1;
+    }
+
+    z.next_in = slot->in;
+    z.avail_in = slot->in_len;
+    z.next_out = slot->out + GZ_HEADER_SIZE;
+    z.avail_out = slot->out_cap - GZ_HEADER_SIZE - GZ_TRAILER_SIZE;
+    int zerr = deflate(&z, Z_FINISH);
+    size_t compressed = z.total_out;
+    deflateEnd(&z);
+    if (zerr != Z_STREAM_END)
+        return -1;
+
+    unsigned char *p = slot->out;
+    slot->out_len = GZ_HEADER_SIZE + compressed + GZ_TRAILER_SIZE;
+    memset(p, 0, GZ_HEADER_SIZE);
+    p[0] = GZ_ID1;
+    p[1] = GZ_ID2;
+    p[2] = GZ_CM_DEFLATE;
+    p[3] = GZ_FEXTRA;
+    p[9] = GZ_OS_UNIX;
+    put2(p + 10, 8);
+    p[12] = BLOCKGZ_SI1;
+    p[13] = BLOCKGZ_SI2;
+    put2(p + 14, 4);
+    put4(p + 16, slot->out_len);
+
+    p += GZ_HEADER_SIZE + compressed;
+    put4(p, crc32(crc32(0L, Z_NULL, 0), slot->in, slot->in_len));
+    put4(p + 4, slot->in_len);
+    return 0;
+}
+
+static int inflate_block(BlockGzSlot *slot)
+{
+    size_t start = 12 + get2(slot->in + 10);
+    if (slot->in_len < start + GZ_TRAILER_SIZE)
+        return -1;
+    uint32_t crc = get4(slot->in + slot->in_len - 8);
+    uint32_t size = get4(slot->in + slot->in_len - 4);
+    // one spare byte so inflate can always report the end of stream
+    if (ensure_capacity(&slot->out, &slot->out_cap, (size_t)size + 1))
+        return -1;
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, -MAX_WBITS) != Z_OK)
+        return -1;
+    z.next_in = slot->in + start;
+    z.avail_in = slot->in_len - start - GZ_TRAILER_SIZE;
+    z.next_out = slot->out;
+    z.avail_out = size + 1;
+    int zerr = inflate(&z, Z_FINISH);
+    size_t inflated = z.total_out;
+    inflateEnd(&z);
+    if (zerr != Z_STREAM_END || inflated != size)
+        return -1;
+    if (crc32(crc32(0L, Z_NULL, 0), slot->out, size) != crc)
+        return -1;
+    slot->out_len = size;
+    return 0;
+}
+
+static void *blockgz_worker(void *cookie)
+{
+    BlockGz *gz = (BlockGz *)cookie;
+    pthread_mutex_lock(&gz->mutex);
+    for (;;) {
+        while (!gz->shutdown && gz->next_work == gz->next_queue)
+            pthread_cond_wait(&gz->cond, &gz->mutex);
+        if (gz->next_work == gz->next_queue)
+            break;
+        BlockGzSlot *slot = &gz->slots[gz->next_work % gz->num_slots];
+        gz->next_work++;
+        pthread_mutex_unlock(&gz->mutex);
+
+        int error = gz->writing ? deflate_block(slot) : inflate_block(slot);
+
+        pthread_mutex_lock(&gz->mutex);
+        slot->error = error;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&gz->cond);
+    }
+    pthread_mutex_unlock(&gz->mutex);
+    return NULL;
+}
+
+static BlockGz *blockgz_open(int fd, int writing)
+{
+    BlockGz *gz = (BlockGz *)calloc(1, sizeof(BlockGz));
+    if (gz == NULL)
+        return NULL;
+    gz->fd = fd;
+    gz->writing = writing;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    gz->num_threads = cpus < 1 ? 1 : cpus > BLOCKGZ_MAX_THREADS ? BLOCKGZ_MAX_THREADS : cpus;
+    // Enough blocks in flight to keep every core busy while the
+    // calling thread writes out (or reads in) the next one.
+    gz->num_slots = 2 * gz->num_threads + 1;
+    gz->slots = (BlockGzSlot *)calloc(gz->num_slots, sizeof(BlockGzSlot));
+    if (gz->slots == NULL) {
+        free(gz);
+        return NULL;
+    }
+    pthread_mutex_init(&gz->mutex, NULL);
+    pthread_cond_init(&gz->cond, NULL);
+    return gz;
+}
+
+static int blockgz_start_threads(BlockGz *gz)
+{
+    int i;
+    for (i = 0; i < gz->num_threads; i++) {
+        if (pthread_create(&gz->threads[i], NULL, blockgz_worker, gz) != 0)
+            break;
+    }
+    gz->num_threads = i;
+    return i == 0 ? -1 : 0;
+}
+
+static void blockgz_free(BlockGz *gz)
+{
+    pthread_mutex_lock(&gz->mutex);
+    gz->shutdown = 1;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->mutex);
+    int i;
+    for (i = 0; i < gz->num_threads; i++)
+        pthread_join(gz->threads[i], NULL);
+
+    for (i = 0; i < gz->num_slots; i++) {
+        free(gz->slots[i].in);
+        free(gz->slots[i].out);
+    }
+    free(gz->slots);
+    if (gz->streaming)
+        inflateEnd(&gz->stream);
+    free(gz->stream_buf);
+    pthread_mutex_destroy(&gz->mutex);
+    pthread_cond_destroy(&gz->cond);
+    free(gz);
+}
+
+static void blockgz_queue(BlockGz *gz, BlockGzSlot *slot)
+{
+    pthread_mutex_lock(&gz->mutex);
+    slot->state = SLOT_QUEUED;
+    gz->next_queue++;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->mutex);
+}
+
+// Wait for the oldest outstanding block and return its slot.
+static BlockGzSlot *blockgz_wait_oldest(BlockGz *gz)
+{
+    BlockGzSlot *slot = &gz->slots[gz->next_done % gz->num_slots];
+    pthread_mutex_lock(&gz->mutex);
+    while (slot->state != SLOT_DONE)
+        pthread_cond_wait(&gz->cond, &gz->mutex);
+    pthread_mutex_unlock(&gz->mutex);
+    return slot;
+}
+
+static void blockgz_release_oldest(BlockGz *gz, BlockGzSlot *slot)
+{
+    pthread_mutex_lock(&gz->mutex);
+    slot->state = SLOT_FREE;
+    slot->in_len = 0;
+    slot->out_len = 0;
+    gz->next_done++;
+    pthread_mutex_unlock(&gz->mutex);
+}
+
+// Write the oldest compressed block to the output, in order.
+static int blockgz_drain_one(BlockGz *gz)
+{
+    BlockGzSlot *slot = blockgz_wait_oldest(gz);
+    if (slot->error) {
+        printf("error compressing block %ld\n", gz->next_done);
+        gz->error = -1;
+    } else if (gz->error == 0) {
+        if (gz->output != NULL)
+            gz->output(slot->out, slot->out_len, gz->cookie);
+        if (write_fully(gz->fd, slot->out, slot->out_len)) {
+            printf("error writing compressed data: %s\n", strerror(errno));
+            gz->error = -1;
+        }
+    }
+    blockgz_release_oldest(gz, slot);
+    return gz->error;
+}
+
+BlockGz *blockgz_open_writer(int fd, blockgz_output_callback output, void *cookie)
+{
+    BlockGz *gz = blockgz_open(fd, 1);
+    if (gz == NULL)
+        return NULL;
+    gz->output = output;
+    gz->cookie = cookie;
+    if (blockgz_start_threads(gz)) {
+        blockgz_free(gz);
+        return NULL;
+    }
+    return gz;
+}
+
+int blockgz_write(BlockGz *gz, const char *data, size_t len)
+{
+    while (len > 0 && gz->error == 0) {
+        BlockGzSlot *slot = &gz->slots[gz->next_queue % gz->num_slots];
+        if (slot->state != SLOT_FREE) {
+            // every slot is busy; make room by writing out the oldest
+            blockgz_drain_one(gz);
+            continue;
+        }
+        if (ensure_capacity(&slot->in, &slot->in_cap, BLOCKGZ_BLOCK_SIZE)) {
+            gz->error = -1;
+            break;
+        }
+        size_t chunk = BLOCKGZ_BLOCK_SIZE - slot->in_len;
+        if (chunk > len)
+            chunk = len;
+        memcpy(slot->in + slot->in_len, data, chunk);
+        slot->in_len += chunk;
+        data += chunk;
+        len -= chunk;
+        if (slot->in_len == BLOCKGZ_BLOCK_SIZE)
+            blockgz_queue(gz, slot);
+    }
+    return gz->error;
+}
+
+int blockgz_close_writer(BlockGz *gz)
+{
+    BlockGzSlot *slot = &gz->slots[gz->next_queue % gz->num_slots];
+    // An empty input still needs one (empty) member to be valid gzip.
+    if (gz->error == 0 && slot->state == SLOT_FREE && (slot->in_len > 0 || gz->next_queue == 0))
+        blockgz_queue(gz, slot);
+    while (gz->next_done < gz->next_queue)
+        blockgz_drain_one(gz);
+    int ret = gz->error;
+    blockgz_free(gz);
+    return ret;
+}
+
+/* Read the next member into slot.  Returns 1 if a member was read, 0
+ * at the end of the input and -1 on error.  If the very first member
+ * was not written by blockgz, the reader switches to streaming mode
+ * and the bytes already consumed are handed to zlib.
+ */
+static int blockgz_read_member(BlockGz *gz, BlockGzSlot *slot)
+{
+    if (ensure_capacity(&slot->in, &slot->in_cap, BLOCKGZ_BLOCK_SIZE))
+        return -1;
+    ssize_t n = read_fully(gz->fd, slot->in, 12);
+    if (n == 0)
+        return 0;
+    if (n < 0)
+        return -1;
+
+    size_t member_len = 0;
+    size_t header_len = n;
+    if (n == 12 && slot->in[0] == GZ_ID1 && slot->in[1] == GZ_ID2 &&
+            slot->in[2] == GZ_CM_DEFLATE && slot->in[3] == GZ_FEXTRA) {
+        size_t xlen = get2(slot->in + 10);
+        n = read_fully(gz->fd, slot->in + 12, xlen);
+        if (n < 0)
+            return -1;
+        header_len += n;
+        if ((size_t)n == xlen) {
+            // look for our subfield among the extra fields
+            const unsigned char *p = slot->in + 12;
+            const unsigned char *end = p + xlen;
+            while (p + 4 <= end) {
+                size_t len = get2(p + 2);
+                if (p[0] == BLOCKGZ_SI1 && p[1] == BLOCKGZ_SI2 && len == 4 && p + 8 <= end) {
+                    member_len = get4(p + 4);
+                    break;
+                }
+                p += 4 + len;
+            }
+        }
+    }
+
+    if (member_len == 0 || member_len < header_len + GZ_TRAILER_SIZE) {
+        if (gz->next_queue != 0) {
+            printf("unexpected gzip member %ld\n", gz->next_queue);
+            return -1;
+        }
+        // the header read so far may hold up to 64K of extra fields
+        size_t buf_len = BLOCKGZ_STREAM_BUFFER_SIZE;
+        if (header_len > buf_len)
+            buf_len = header_len;
+        gz->stream_buf = (unsigned char *)malloc(buf_len);
+        if (gz->stream_buf == NULL)
+            return -1;
+        memset(&gz->stream, 0, sizeof(gz->stream));
+        if (inflateInit2(&gz->stream, 16 + MAX_WBITS) != Z_OK)
+            return -1;
+        gz->streaming = 1;
+        memcpy(gz->stream_buf, slot->in, header_len);
+        gz->stream.next_in = gz->stream_buf;
+        gz->stream.avail_in = header_len;
+        return 0;
+    }
+
+    if (ensure_capacity(&slot->in, &slot->in_cap, member_len))
+        return -1;
+    n = read_fully(gz->fd, slot->in + header_len, member_len - header_len);
+    if (n != (ssize_t)(member_len - header_len)) {
+        printf("truncated gzip member %ld\n", gz->next_queue);
+        return -1;
+    }
+    slot->in_len = member_len;
+    return 1;
+}
+
+// Keep every free slot filled with a member waiting to be inflated.
+static int blockgz_fill(BlockGz *gz)
+{
+    while (!gz->input_done) {
+        BlockGzSlot *slot = &gz->slots[gz->next_queue % gz->num_slots];
+        if (slot->state != SLOT_FREE)
+            break;
+        int ret = blockgz_read_member(gz, slot);
+        if (ret < 0)
+            return -1;
+        if (ret == 0) {
+            gz->input_done = 1;
+            break;
+        }
+        blockgz_queue(gz, slot);
+    }
+    return 0;
+}
+
+static ssize_t blockgz_stream_read(BlockGz *gz, char *data, size_t len)
+{
+    z_stream *z = &gz->stream;
+    z->next_out = (unsigned char *)data;
+    z->avail_out = len;
+    while (z->avail_out > 0) {
+        if (z->avail_in == 0) {
+            ssize_t n = read_fully(gz->fd, gz->stream_buf, BLOCKGZ_STREAM_BUFFER_SIZE);
+            if (n < 0)
+                return -1;
+            if (n == 0) {
+                if (!gz->member_done) {
+                    printf("truncated gzip stream\n");
+                    return -1;
+                }
+                break;
+            }
+            z->next_in = gz->stream_buf;
+            z->avail_in = n;
+        }
+        // more input after the end of a member is the next member
+        if (gz->member_done) {
+            inflateReset(z);
+            gz->member_done = 0;
+        }
+        int zerr = inflate(z, Z_NO_FLUSH);
+        if (zerr == Z_STREAM_END) {
+            gz->member_done = 1;
+        } else if (zerr != Z_OK) {
+            printf("error inflating gzip stream (zerr=%d)\n", zerr);
+            return -1;
+        }
+    }
+    return len - z->avail_out;
+}
+
+BlockGz *blockgz_open_reader(int fd)
+{
+    BlockGz *gz = blockgz_open(fd, 0);
+    if (gz == NULL)
+        return NULL;
+    if (blockgz_fill(gz) == 0 && (gz->streaming || blockgz_start_threads(gz) == 0))
+        return gz;
+    blockgz_free(gz);
+    return NULL;
+}
+
+ssize_t blockgz_read(BlockGz *gz, char *data, size_t len)
+{
+    if (gz->error)
+        return -1;
+    if (gz->streaming)
+        return blockgz_stream_read(gz, data, len);
+
+    size_t total = 0;
+    while (total < len) {
+        if (blockgz_fill(gz)) {
+            gz->error = -1;
+            return -1;
+        }
+        if (gz->next_done == gz->next_queue)
+            break;
+        BlockGzSlot *slot = blockgz_wait_oldest(gz);
+        if (slot->error) {
+            printf("error inflating block %ld\n", gz->next_done);
+            gz->error = -1;
+            return -1;
+        }
+        size_t chunk = slot->out_len - gz->out_pos;
+        if (chunk > len - total)
+            chunk = len - total;
+        memcpy(data + total, slot->out + gz->out_pos, chunk);
+        gz->out_pos += chunk;
+        total += chunk;
+        if (gz->out_pos == slot->out_len) {
+            blockgz_release_oldest(gz, slot);
+            gz->out_pos = 0;
+        }
+    }
+    return total;
+}
+
+void blockgz_close_reader(BlockGz *gz)
+{
+    blockgz_free(gz);
+}
+
+int blockgz_is_gzip(int fd)
+{
+    unsigned char magic[2];
+    return pread(fd, magic, 2, 0) == 2 && magic[0] == GZ_ID1 && magic[1] == GZ_ID2;
+}
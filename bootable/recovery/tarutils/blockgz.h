@@ -0,0 +1,52 @@
+#ifndef BLOCKGZ_H_
+#define BLOCKGZ_H_
+
+#include <sys/types.h>
+
+/* Parallel gzip streams.
+ *
+ * The data is cut into fixed size blocks that are compressed
+ * independently on all cores, each into a complete gzip member.  A
+ * sequence of members is itself a valid gzip file, so the result can
+ * be inspected with gunzip or zcat on a desktop.  Every member carries
+ * its own compressed length in a gzip extra field, which lets the
+ * reader split the stream and inflate the blocks in parallel too.
+ */
+
+// Every member but the last holds exactly this much data, so the
+// member holding a given offset can be found without inflating the
+// ones before it.
+#define BLOCKGZ_BLOCK_SIZE  (1024 * 1024)
+
+typedef struct BlockGz BlockGz;
+
+// Invoked with the compressed data, in order, just before it is
+// written to the output.
+typedef void (*blockgz_output_callback)(const void *data, size_t len, void *cookie);
+
+// Start compressing into fd.  output may be NULL.  Returns NULL on
+// failure.
+BlockGz *blockgz_open_writer(int fd, blockgz_output_callback output, void *cookie);
+
+// Queue len bytes for compression.  Returns 0 on success.
+int blockgz_write(BlockGz *gz, const char *data, size_t len);
+
+// Flush all pending blocks and free gz; fd is left open.  Returns 0
+// if every block was compressed and written successfully.
+int blockgz_close_writer(BlockGz *gz);
+
+// Start decompressing the gzip stream in fd.  Plain gzip files that
+// were not written by blockgz are inflated on a single thread.
+BlockGz *blockgz_open_reader(int fd);
+
+// Read up to len bytes of uncompressed data.  Returns the number of
+// bytes read, 0 at the end of the stream or -1 on error.
+ssize_t blockgz_read(BlockGz *gz, char *data, size_t len);
+
+void blockgz_close_reader(BlockGz *gz);
+
+// Returns nonzero if fd starts with the gzip magic.  The file offset
+// is left untouched.
+int blockgz_is_gzip(int fd);
+
+#endif  // BLOCKGZ_H_
@@ -0,0 +1,1410 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "minzip/DirUtil.h"
+#include "minzip/Hash.h"
+#include "blockgz.h"
+#include "tarutils.h"
+
+#define TAR_BLOCK_SIZE      512
+// Both the writer and the reader move data in chunks of this size,
+// which must be a multiple of TAR_BLOCK_SIZE.
+#define TAR_BUFFER_SIZE     (256 * 1024)
+#define TAR_LONGLINK        "././@LongLink"
+#define TAR_INDEX_VERSION   "tarindex 1"
+// Closer entries are reached by reading through rather than seeking.
+#define TAR_SEEK_DISTANCE   (1024 * 1024)
+
+#define TAR_TYPE_FILE       '0'
+#define TAR_TYPE_HARDLINK   '1'
+#define TAR_TYPE_SYMLINK    '2'
+#define TAR_TYPE_CHAR       '3'
+#define TAR_TYPE_BLOCK      '4'
+#define TAR_TYPE_DIR        '5'
+#define TAR_TYPE_FIFO       '6'
+#define TAR_TYPE_CONTIGUOUS '7'
+#define TAR_TYPE_GNU_LONGLINK 'K'
+#define TAR_TYPE_GNU_LONGNAME 'L'
+#define TAR_TYPE_PAX_HEADER 'x'
+#define TAR_TYPE_PAX_GLOBAL 'g'
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+} TarHeader;
+
+static unsigned int header_checksum(const TarHeader *header)
+{
+    const unsigned char *p = (const unsigned char *)header;
+    unsigned int sum = 0;
+    unsigned int i;
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (i >= offsetof(TarHeader, chksum) &&
+                i < offsetof(TarHeader, chksum) + sizeof(header->chksum))
+            sum += ' ';
+        else
+            sum += p[i];
+    }
+    return sum;
+}
+
+static void set_checksum(TarHeader *header)
+{
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", header_checksum(header));
+    header->chksum[7] = ' ';
+}
+
+/* Store value as a NUL terminated octal number, falling back to the
+ * GNU base-256 encoding when it does not fit (files over 8GB).
+ */
+static void put_number(char *field, int size, uint64_t value)
+{
+    if ((value >> (3 * (size - 1))) != 0) {
+        int i;
+        for (i = size - 1; i > 0; i--) {
+            field[i] = value & 0xff;
+            value >>= 8;
+        }
+        field[0] = 0x80;
+        return;
+    }
+    snprintf(field, size, "%0*llo", size - 1, (unsigned long long)value);
+}
+
+static uint64_t get_number(const char *field, int size)
+{
+    uint64_t value = 0;
+    int i = 0;
+    if ((unsigned char)field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (i = 1; i < size; i++)
+            value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+    while (i < size && field[i] == ' ')
+        i++;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++)
+        value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+static int write_fully(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Archive creation.
+ */
+
+typedef struct TarHardLink {
+    dev_t dev;
+    ino_t ino;
+    char *name;
+    struct TarHardLink *next;
+} TarHardLink;
+
+typedef struct {
+    int fd;
+    BlockGz *gz;            // non-NULL when compressing
+    char *buf;
+    size_t len;
+    char path[PATH_MAX];
+    int name_offset;        // start of the entry name within path
+    const char **excludes;
+    TarHardLink *links;
+    uint64_t bytes;
+    int files;
+    tar_output_callback output;
+    tar_progress_callback callback;
+    void *cookie;
+    FILE *index;            // non-NULL with TAR_INDEX
+    uint64_t flushed;       // uncompressed bytes written out so far
+    uint64_t compressed;    // compressed bytes written out so far
+} TarWriter;
+
+static int writer_flush(TarWriter *w)
+{
+    if (w->len == 0)
+        return 0;
+    if (w->gz != NULL) {
+        // the compressor hands the compressed data to w->output
+        if (blockgz_write(w->gz, w->buf, w->len))
+            return -1;
+    } else {
+        if (w->output != NULL)
+            w->output(w->buf, w->len, w->cookie);
+        if (write_fully(w->fd, w->buf, w->len)) {
+            printf("error writing archive: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    w->flushed += w->len;
+    w->len = 0;
+    return 0;
+}
+
+// Every gzip member starts a new block of BLOCKGZ_BLOCK_SIZE bytes;
+// the index records where each one begins.
+static void writer_compressed_output(const void *data, size_t len, void *cookie)
+{
+    TarWriter *w = (TarWriter *)cookie;
+    if (w->index != NULL)
+        fprintf(w->index, "m %llu\n", (unsigned long long)w->compressed);
+    w->compressed += len;
+    if (w->output != NULL)
+        w->output(data, len, w->cookie);
+}
+
+static void writer_index_entry(TarWriter *w, uint64_t offset, uint64_t size, const char *name)
+{
+    // names with newlines can't be indexed; tar_list and
+    // tar_extract_paths simply won't find them
+    if (w->index != NULL && strchr(name, '\n') == NULL)
+        fprintf(w->index, "e %llu %llu %s\n", (unsigned long long)offset,
+                (unsigned long long)size, name);
+}
+
+// Return a zeroed region of len (<= TAR_BUFFER_SIZE) bytes in the
+// output buffer, flushing it first if necessary.
+static char *writer_reserve(TarWriter *w, size_t len)
+{
+    if (w->len + len > TAR_BUFFER_SIZE && writer_flush(w))
+        return NULL;
+    char *p = w->buf + w->len;
+    memset(p, 0, len);
+    w->len += len;
+    return p;
+}
+
+static int writer_pad(TarWriter *w, uint64_t size)
+{
+    size_t pad = (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+    if (pad != 0 && writer_reserve(w, pad) == NULL)
+        return -1;
+    return 0;
+}
+
+static int write_long_name(TarWriter *w, char type, const char *name)
+{
+    size_t len = strlen(name) + 1;
+    TarHeader *header = (TarHeader *)writer_reserve(w, TAR_BLOCK_SIZE);
+    if (header == NULL)
+        return -1;
+    strcpy(header->name, TAR_LONGLINK);
+    put_number(header->mode, sizeof(header->mode), 0);
+    put_number(header->uid, sizeof(header->uid), 0);
+    put_number(header->gid, sizeof(header->gid), 0);
+    put_number(header->size, sizeof(header->size), len);
+    put_number(header->mtime, sizeof(header->mtime), 0);
+    header->typeflag = type;
+    memcpy(header->magic, "ustar  ", 8);
+    set_checksum(header);
+
+    // PATH_MAX is far below TAR_BUFFER_SIZE, so one reservation does.
+    char *data = writer_reserve(w, len);
+    if (data == NULL)
+        return -1;
+    memcpy(data, name, len);
+    return writer_pad(w, len);
+}
+
+static int write_header(TarWriter *w, const char *name, const struct stat *st,
+        char type, const char *linkname, uint64_t size)
+{
+    if (strlen(name) >= sizeof(((TarHeader *)0)->name) &&
+            write_long_name(w, TAR_TYPE_GNU_LONGNAME, name))
+        return -1;
+    if (linkname != NULL && strlen(linkname) >= sizeof(((TarHeader *)0)->linkname) &&
+            write_long_name(w, TAR_TYPE_GNU_LONGLINK, linkname))
+        return -1;
+
+    TarHeader *header = (TarHeader *)writer_reserve(w, TAR_BLOCK_SIZE);
+    if (header == NULL)
+        return -1;
+    strncpy(header->name, name, sizeof(header->name));
+    put_number(header->mode, sizeof(header->mode), st->st_mode & 07777);
+    put_number(header->uid, sizeof(header->uid), st->st_uid);
+    put_number(header->gid, sizeof(header->gid), st->st_gid);
+    put_number(header->size, sizeof(header->size), size);
+    put_number(header->mtime, sizeof(header->mtime), st->st_mtime);
+    header->typeflag = type;
+    if (linkname != NULL)
+        strncpy(header->linkname, linkname, sizeof(header->linkname));
+    memcpy(header->magic, "ustar  ", 8);
+    if (type == TAR_TYPE_CHAR || type == TAR_TYPE_BLOCK) {
+        put_number(header->devmajor, sizeof(header->devmajor), major(st->st_rdev));
+        put_number(header->devminor, sizeof(header->devminor), minor(st->st_rdev));
+    }
+    set_checksum(header);
+    return 0;
+}
+
+static int write_file_data(TarWriter *w, const char *path, uint64_t size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Read straight into the output buffer.  If the file shrinks while
+    // we are reading it, pad with zeros so the archive stays consistent
+    // with the size already recorded in the header.
+    uint64_t remaining = size;
+    int eof = 0;
+    while (remaining > 0) {
+        if (w->len == TAR_BUFFER_SIZE && writer_flush(w)) {
+            close(fd);
+            return -1;
+        }
+        size_t chunk = TAR_BUFFER_SIZE - w->len;
+        if (chunk > remaining)
+            chunk = remaining;
+        ssize_t n = 0;
+        if (!eof) {
+            n = read(fd, w->buf + w->len, chunk);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                printf("error reading %s: %s\n", path, strerror(errno));
+                close(fd);
+                return -1;
+            }
+            if (n == 0)
+                eof = 1;
+        }
+        if (eof) {
+            memset(w->buf + w->len, 0, chunk);
+            n = chunk;
+        }
+        w->len += n;
+        remaining -= n;
+        w->bytes += n;
+    }
+    close(fd);
+    return writer_pad(w, size);
+}
+
+static int is_excluded(const char **excludes, const char *name)
+{
+    const char **exclude;
+    if (excludes == NULL)
+        return 0;
+    for (exclude = excludes; *exclude != NULL; exclude++) {
+        if (strcmp(name, *exclude) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static const char *find_hard_link(TarWriter *w, const char *name, const struct stat *st)
+{
+    TarHardLink *link;
+    for (link = w->links; link != NULL; link = link->next) {
+        if (link->dev == st->st_dev && link->ino == st->st_ino)
+            return link->name;
+    }
+    link = (TarHardLink *)malloc(sizeof(TarHardLink));
+    if (link != NULL) {
+        link->dev = st->st_dev;
+        link->ino = st->st_ino;
+        link->name = strdup(name);
+        link->next = w->links;
+        w->links = link;
+    }
+    return NULL;
+}
+
+static int archive_path(TarWriter *w, const struct stat *st);
+
+static int archive_directory(TarWriter *w)
+{
+    DIR *dir = opendir(w->path);
+    if (dir == NULL) {
+        printf("error opening directory %s: %s\n", w->path, strerror(errno));
+        return -1;
+    }
+
+    size_t len = strlen(w->path);
+    struct dirent *de;
+    int ret = 0;
+    while (ret == 0 && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (len + 1 + strlen(de->d_name) >= sizeof(w->path)) {
+            printf("path too long: %s/%s\n", w->path, de->d_name);
+            ret = -1;
+            break;
+        }
+        w->path[len] = '/';
+        strcpy(w->path + len + 1, de->d_name);
+
+        struct stat st;
+        if (lstat(w->path, &st)) {
+            printf("error opening %s: %s\n", w->path, strerror(errno));
+            ret = -1;
+        } else {
+            ret = archive_path(w, &st);
+        }
+        w->path[len] = '\0';
+    }
+    closedir(dir);
+    return ret;
+}
+
+static int archive_path(TarWriter *w, const struct stat *st)
+{
+    const char *name = w->path + w->name_offset;
+    if (is_excluded(w->excludes, name))
+        return 0;
+
+    int ret;
+    uint64_t offset = w->flushed + w->len;
+    uint64_t size = 0;
+    if (S_ISREG(st->st_mode)) {
+        const char *link = NULL;
+        if (st->st_nlink > 1)
+            link = find_hard_link(w, name, st);
+        if (link != NULL) {
+            ret = write_header(w, name, st, TAR_TYPE_HARDLINK, link, 0);
+        } else {
+            size = st->st_size;
+            ret = write_header(w, name, st, TAR_TYPE_FILE, NULL, size);
+            if (ret == 0)
+                ret = write_file_data(w, w->path, size);
+        }
+    } else if (S_ISDIR(st->st_mode)) {
+        char dirname[PATH_MAX];
+        snprintf(dirname, sizeof(dirname), "%s/", name);
+        ret = write_header(w, dirname, st, TAR_TYPE_DIR, NULL, 0);
+        if (ret == 0)
+            writer_index_entry(w, offset, 0, dirname);
+    } else if (S_ISLNK(st->st_mode)) {
+        char link[PATH_MAX];
+        ssize_t n = readlink(w->path, link, sizeof(link) - 1);
+        if (n < 0) {
+            printf("error reading symlink %s: %s\n", w->path, strerror(errno));
+            return -1;
+        }
+        link[n] = '\0';
+        ret = write_header(w, name, st, TAR_TYPE_SYMLINK, link, 0);
+    } else if (S_ISCHR(st->st_mode)) {
+        ret = write_header(w, name, st, TAR_TYPE_CHAR, NULL, 0);
+    } else if (S_ISBLK(st->st_mode)) {
+        ret = write_header(w, name, st, TAR_TYPE_BLOCK, NULL, 0);
+    } else if (S_ISFIFO(st->st_mode)) {
+        ret = write_header(w, name, st, TAR_TYPE_FIFO, NULL, 0);
+    } else {
+        printf("skipping socket %s\n", w->path);
+        return 0;
+    }
+    if (ret != 0)
+        return ret;
+    if (!S_ISDIR(st->st_mode))
+        writer_index_entry(w, offset, size, name);
+
+    w->files++;
+    if (w->callback != NULL)
+        w->callback(name, w->bytes, w->files, w->cookie);
+
+    if (S_ISDIR(st->st_mode))
+        return archive_directory(w);
+    return 0;
+}
+
+int tar_create(const char *archive, const char *directory,
+        const char **excludes, int flags, tar_output_callback output,
+        tar_progress_callback callback, void *cookie)
+{
+    TarWriter *w = (TarWriter *)calloc(1, sizeof(TarWriter));
+    if (w == NULL)
+        return -1;
+    w->buf = (char *)malloc(TAR_BUFFER_SIZE);
+    if (w->buf == NULL) {
+        free(w);
+        return -1;
+    }
+    w->excludes = excludes;
+    w->output = output;
+    w->callback = callback;
+    w->cookie = cookie;
+
+    // Strip trailing slashes; the entry names start after the last
+    // remaining one.
+    strncpy(w->path, directory, sizeof(w->path) - 1);
+    size_t len = strlen(w->path);
+    while (len > 1 && w->path[len - 1] == '/')
+        w->path[--len] = '\0';
+    char *slash = strrchr(w->path, '/');
+    w->name_offset = slash == NULL ? 0 : slash - w->path + 1;
+
+    char index[PATH_MAX];
+    snprintf(index, sizeof(index), "%s.idx", archive);
+    if (flags & TAR_INDEX) {
+        if ((w->index = fopen(index, "w")) == NULL)
+            printf("error creating %s: %s\n", index, strerror(errno));
+        else
+            fprintf(w->index, "%s\n", TAR_INDEX_VERSION);
+    }
+
+    int ret = -1;
+    struct stat st;
+    w->fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        printf("error creating %s: %s\n", archive, strerror(errno));
+    } else if ((flags & TAR_INDEX) && w->index == NULL) {
+        // already reported
+    } else if ((flags & TAR_GZIP) && (w->gz = blockgz_open_writer(w->fd, writer_compressed_output, w)) == NULL) {
+        printf("error starting compression of %s\n", archive);
+    } else if (lstat(w->path, &st)) {
+        printf("error opening %s: %s\n", w->path, strerror(errno));
+    } else if (0 == (ret = archive_path(w, &st))) {
+        // Two zero blocks mark the end of the archive.
+        if (writer_reserve(w, 2 * TAR_BLOCK_SIZE) == NULL || writer_flush(w))
+            ret = -1;
+    }
+
+    if (w->gz != NULL && blockgz_close_writer(w->gz) && ret == 0) {
+        printf("error compressing %s\n", archive);
+        ret = -1;
+    }
+    if (w->fd >= 0 && close(w->fd) && ret == 0) {
+        printf("error closing %s: %s\n", archive, strerror(errno));
+        ret = -1;
+    }
+    if (w->index != NULL && (fclose(w->index) || ret != 0)) {
+        unlink(index);
+        if (ret == 0) {
+            printf("error writing %s\n", index);
+            ret = -1;
+        }
+    }
+    while (w->links != NULL) {
+        TarHardLink *next = w->links->next;
+        free(w->links->name);
+        free(w->links);
+        w->links = next;
+    }
+    free(w->buf);
+    free(w);
+    return ret;
+}
+
+/*
+ * Archive extraction.
+ */
+
+typedef struct {
+    int fd;
+    BlockGz *gz;            // non-NULL for compressed archives
+    char *buf;
+    size_t pos;
+    size_t len;
+    uint64_t bytes;
+    int files;
+    int flags;
+    const char **excludes;
+    HashTable *names;       // every entry name, for TAR_DELTA
+    char *cmp;              // existing file data, for TAR_DELTA_CONTENT
+    uint64_t base;          // archive offset of buf[0], uncompressed
+    uint64_t *members;      // offset of every gzip member, from the index
+    int num_members;
+} TarReader;
+
+static int reader_fill(TarReader *r)
+{
+    if (r->pos < r->len)
+        return 0;
+    r->base += r->len;
+    ssize_t n;
+    if (r->gz != NULL) {
+        n = blockgz_read(r->gz, r->buf, TAR_BUFFER_SIZE);
+    } else {
+        do {
+            n = read(r->fd, r->buf, TAR_BUFFER_SIZE);
+        } while (n < 0 && errno == EINTR);
+    }
+    if (n <= 0) {
+        printf("unexpected end of archive\n");
+        return -1;
+    }
+    r->pos = 0;
+    r->len = n;
+    return 0;
+}
+
+// Copy (or with data == NULL, discard) the next len bytes.
+static int reader_read(TarReader *r, char *data, uint64_t len)
+{
+    while (len > 0) {
+        if (reader_fill(r))
+            return -1;
+        size_t chunk = r->len - r->pos;
+        if (chunk > len)
+            chunk = len;
+        if (data != NULL) {
+            memcpy(data, r->buf + r->pos, chunk);
+            data += chunk;
+        }
+        r->pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int reader_skip_padding(TarReader *r, uint64_t size)
+{
+    return reader_read(r, NULL, (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE);
+}
+
+// Read a GNU long name record of size bytes into out (PATH_MAX).
+static int read_long_name(TarReader *r, char *out, uint64_t size)
+{
+    uint64_t keep = size < PATH_MAX - 1 ? size : PATH_MAX - 1;
+    if (reader_read(r, out, keep) || reader_read(r, NULL, size - keep))
+        return -1;
+    out[keep] = '\0';
+    return reader_skip_padding(r, size);
+}
+
+// Pick the path and linkpath keywords out of a pax extended header.
+static int read_pax_header(TarReader *r, char *name, char *linkname, uint64_t size)
+{
+    if (size > 64 * 1024) {
+        printf("pax header too large\n");
+        return -1;
+    }
+    char *data = (char *)malloc(size + 1);
+    if (data == NULL)
+        return -1;
+    if (reader_read(r, data, size) || reader_skip_padding(r, size)) {
+        free(data);
+        return -1;
+    }
+    data[size] = '\0';
+
+    // Each record is "<length> <keyword>=<value>\n".
+    char *record = data;
+    while (record < data + size) {
+        char *end;
+        long len = strtol(record, &end, 10);
+        if (len <= 0 || *end != ' ' || record + len > data + size)
+            break;
+        char *keyword = end + 1;
+        char *value = strchr(keyword, '=');
+        if (value != NULL && value < record + len) {
+            size_t value_len = record + len - 1 - (value + 1);
+            char *target = NULL;
+            if (strncmp(keyword, "path=", 5) == 0)
+                target = name;
+            else if (strncmp(keyword, "linkpath=", 9) == 0)
+                target = linkname;
+            if (target != NULL && value_len < PATH_MAX) {
+                memcpy(target, value + 1, value_len);
+                target[value_len] = '\0';
+            }
+        }
+        record += len;
+    }
+    free(data);
+    return 0;
+}
+
+// Turn an entry name into something that is safe to create below the
+// target directory: no absolute paths, no "..", no trailing slash.
+static int sanitize_name(char *name)
+{
+    char *p = name;
+    while (*p == '/')
+        p++;
+    while (strncmp(p, "./", 2) == 0)
+        p += 2;
+    memmove(name, p, strlen(p) + 1);
+
+    size_t len = strlen(name);
+    while (len > 0 && name[len - 1] == '/')
+        name[--len] = '\0';
+
+    for (p = name; p != NULL; p = strchr(p, '/')) {
+        if (*p == '/')
+            p++;
+        if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0'))
+            return -1;
+    }
+    return 0;
+}
+
+static int make_parent_directories(const char *path)
+{
+    return dirCreateHierarchy(path, 0755, NULL, true);
+}
+
+static int extract_file(TarReader *r, const char *path, uint64_t size)
+{
+    unlink(path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 && errno == ENOENT && make_parent_directories(path) == 0)
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        printf("error creating %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Hand the read buffer straight to write().
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        if (reader_fill(r)) {
+            close(fd);
+            return -1;
+        }
+        size_t chunk = r->len - r->pos;
+        if (chunk > remaining)
+            chunk = remaining;
+        if (write_fully(fd, r->buf + r->pos, chunk)) {
+            printf("error writing %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        r->pos += chunk;
+        remaining -= chunk;
+        r->bytes += chunk;
+    }
+    if (close(fd)) {
+        printf("error closing %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return reader_skip_padding(r, size);
+}
+
+static int pwrite_fully(int fd, const char *data, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Bring an existing file up to date in place, writing only the chunks
+// that differ from the archive.
+static int update_file(TarReader *r, const char *path, uint64_t size)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+        return extract_file(r, path, size);
+    if (r->cmp == NULL && (r->cmp = (char *)malloc(TAR_BUFFER_SIZE)) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    uint64_t offset = 0;
+    while (offset < size) {
+        if (reader_fill(r)) {
+            close(fd);
+            return -1;
+        }
+        size_t chunk = r->len - r->pos;
+        if (chunk > size - offset)
+            chunk = size - offset;
+        ssize_t n = pread(fd, r->cmp, chunk, offset);
+        if ((n != (ssize_t)chunk || memcmp(r->cmp, r->buf + r->pos, chunk) != 0) &&
+                pwrite_fully(fd, r->buf + r->pos, chunk, offset)) {
+            printf("error writing %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        r->pos += chunk;
+        offset += chunk;
+        r->bytes += chunk;
+    }
+    if (ftruncate(fd, size) || close(fd)) {
+        printf("error updating %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return reader_skip_padding(r, size);
+}
+
+static int same_type(char typeflag, mode_t mode)
+{
+    switch (typeflag) {
+    case TAR_TYPE_FILE:
+    case TAR_TYPE_CONTIGUOUS:
+    case TAR_TYPE_HARDLINK:
+    case '\0':
+        return S_ISREG(mode);
+    case TAR_TYPE_DIR:
+        return S_ISDIR(mode);
+    case TAR_TYPE_SYMLINK:
+        return S_ISLNK(mode);
+    case TAR_TYPE_CHAR:
+        return S_ISCHR(mode);
+    case TAR_TYPE_BLOCK:
+        return S_ISBLK(mode);
+    case TAR_TYPE_FIFO:
+        return S_ISFIFO(mode);
+    }
+    return 0;
+}
+
+static int extract_entry(TarReader *r, const char *directory, const TarHeader *header,
+        const char *name, const char *linkname)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", directory, name) >= (int)sizeof(path)) {
+        printf("path too long: %s\n", name);
+        return -1;
+    }
+
+    mode_t mode = get_number(header->mode, sizeof(header->mode)) & 07777;
+    uid_t uid = get_number(header->uid, sizeof(header->uid));
+    gid_t gid = get_number(header->gid, sizeof(header->gid));
+    uint64_t size = get_number(header->size, sizeof(header->size));
+    struct utimbuf times;
+    times.actime = times.modtime = get_number(header->mtime, sizeof(header->mtime));
+
+    // In delta mode whatever already matches the archive is left alone.
+    struct stat st;
+    int exists = (r->flags & TAR_DELTA) && lstat(path, &st) == 0;
+    if (exists && !same_type(header->typeflag, st.st_mode)) {
+        if (S_ISDIR(st.st_mode))
+            dirUnlinkHierarchy(path);
+        else
+            unlink(path);
+        exists = 0;
+    }
+
+    int ret = 0;
+    switch (header->typeflag) {
+    case TAR_TYPE_FILE:
+    case TAR_TYPE_CONTIGUOUS:
+    case '\0':
+        if (exists && (r->flags & TAR_DELTA_CONTENT)) {
+            if (update_file(r, path, size))
+                return -1;
+            // the contents may have been touched
+            exists = 0;
+        } else if (exists && (uint64_t)st.st_size == size && st.st_mtime == times.modtime) {
+            if (reader_read(r, NULL, size) || reader_skip_padding(r, size))
+                return -1;
+            r->bytes += size;
+        } else {
+            if (extract_file(r, path, size))
+                return -1;
+            exists = 0;
+        }
+        break;
+    case TAR_TYPE_DIR: {
+        if (mkdir(path, mode) && errno == ENOENT && make_parent_directories(path) == 0)
+            mkdir(path, mode);
+        if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+            printf("error creating directory %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        break;
+    }
+    case TAR_TYPE_SYMLINK:
+        if (exists) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(path, target, sizeof(target) - 1);
+            if (len >= 0 && (target[len] = '\0', strcmp(target, linkname) == 0)) {
+                if (st.st_uid != uid || st.st_gid != gid)
+                    lchown(path, uid, gid);
+                return 0;
+            }
+        }
+        unlink(path);
+        ret = symlink(linkname, path);
+        if (ret && errno == ENOENT && make_parent_directories(path) == 0)
+            ret = symlink(linkname, path);
+        if (ret) {
+            printf("error creating symlink %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        lchown(path, uid, gid);
+        return 0;
+    case TAR_TYPE_HARDLINK: {
+        char target[PATH_MAX];
+        snprintf(target, sizeof(target), "%s/%s", directory, linkname);
+        struct stat target_st;
+        if (exists && lstat(target, &target_st) == 0 &&
+                target_st.st_dev == st.st_dev && target_st.st_ino == st.st_ino)
+            return 0;
+        unlink(path);
+        if (link(target, path)) {
+            printf("error linking %s to %s: %s\n", path, target, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    case TAR_TYPE_CHAR:
+    case TAR_TYPE_BLOCK:
+    case TAR_TYPE_FIFO: {
+        mode_t type = header->typeflag == TAR_TYPE_CHAR ? S_IFCHR :
+                header->typeflag == TAR_TYPE_BLOCK ? S_IFBLK : S_IFIFO;
+        dev_t dev = makedev(get_number(header->devmajor, sizeof(header->devmajor)),
+                get_number(header->devminor, sizeof(header->devminor)));
+        if (exists && (type == S_IFIFO || st.st_rdev == dev))
+            break;
+        unlink(path);
+        ret = mknod(path, type | mode, dev);
+        if (ret && errno == ENOENT && make_parent_directories(path) == 0)
+            ret = mknod(path, type | mode, dev);
+        if (ret) {
+            printf("error creating node %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        exists = 0;
+        break;
+    }
+    default:
+        printf("skipping %s of unknown type '%c'\n", name, header->typeflag);
+        return reader_read(r, NULL, size) || reader_skip_padding(r, size);
+    }
+
+    // chown first, it clears the setuid/setgid bits.
+    int chowned = 0;
+    if (!exists || st.st_uid != uid || st.st_gid != gid) {
+        chown(path, uid, gid);
+        chowned = 1;
+    }
+    if (!exists || chowned || (st.st_mode & 07777) != mode)
+        chmod(path, mode);
+    if (!exists || st.st_mtime != times.modtime)
+        utime(path, &times);
+    return 0;
+}
+
+static unsigned int name_hash(const char *name)
+{
+    unsigned int hash = 5381;
+    while (*name != '\0')
+        hash = hash * 33 + (unsigned char)*name++;
+    return hash;
+}
+
+static int name_compare(const void *a, const void *b)
+{
+    return strcmp((const char *)a, (const char *)b);
+}
+
+// Record name and all of its parents as present in the archive.
+static int remember_name(TarReader *r, const char *name)
+{
+    char *copy = strdup(name);
+    if (copy == NULL)
+        return -1;
+    for (;;) {
+        char *item = strdup(copy);
+        if (item == NULL) {
+            free(copy);
+            return -1;
+        }
+        void *found = mzHashTableLookup(r->names, name_hash(item), item, name_compare, true);
+        if (found != item) {
+            // its parents are already there too
+            free(item);
+            break;
+        }
+        char *slash = strrchr(copy, '/');
+        if (slash == NULL)
+            break;
+        *slash = '\0';
+    }
+    free(copy);
+    return 0;
+}
+
+// Delete everything below path that the archive doesn't contain.
+// path + root_len + 1 is the entry name.
+static int remove_extras(TarReader *r, char *path, size_t root_len)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+
+    size_t len = strlen(path);
+    struct dirent *de;
+    int ret = 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (len + 1 + strlen(de->d_name) >= PATH_MAX)
+            continue;
+        path[len] = '/';
+        strcpy(path + len + 1, de->d_name);
+        const char *name = path + root_len + 1;
+
+        struct stat st;
+        if (is_excluded(r->excludes, name) || lstat(path, &st)) {
+            // leave it alone
+        } else if (mzHashTableLookup(r->names, name_hash(name), (void *)name, name_compare, false) == NULL) {
+            if (S_ISDIR(st.st_mode) ? dirUnlinkHierarchy(path) : unlink(path)) {
+                printf("error removing %s: %s\n", path, strerror(errno));
+                ret = -1;
+            }
+        } else if (S_ISDIR(st.st_mode)) {
+            ret |= remove_extras(r, path, root_len);
+        }
+        path[len] = '\0';
+    }
+    closedir(dir);
+    return ret;
+}
+
+typedef struct {
+    TarReader *r;
+    const char *directory;
+    int ret;
+} RemoveExtrasArgs;
+
+static int remove_extras_below_root(void *data, void *cookie)
+{
+    RemoveExtrasArgs *args = (RemoveExtrasArgs *)cookie;
+    const char *name = (const char *)data;
+    if (strchr(name, '/') != NULL)
+        return 0;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", args->directory, name);
+    args->ret |= remove_extras(args->r, path, strlen(args->directory));
+    return 0;
+}
+
+static int reader_open(TarReader *r, const char *archive)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = open(archive, O_RDONLY);
+    if (r->fd < 0) {
+        printf("error opening %s: %s\n", archive, strerror(errno));
+        return -1;
+    }
+    if (blockgz_is_gzip(r->fd) && (r->gz = blockgz_open_reader(r->fd)) == NULL) {
+        printf("error starting decompression of %s\n", archive);
+        close(r->fd);
+        return -1;
+    }
+    r->buf = (char *)malloc(TAR_BUFFER_SIZE);
+    if (r->buf == NULL) {
+        if (r->gz != NULL)
+            blockgz_close_reader(r->gz);
+        close(r->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void reader_close(TarReader *r)
+{
+    if (r->gz != NULL)
+        blockgz_close_reader(r->gz);
+    close(r->fd);
+    free(r->buf);
+    free(r->cmp);
+    free(r->members);
+    if (r->names != NULL)
+        mzHashTableFree(r->names);
+}
+
+/* Read the headers of the next entry.  name and linkname (PATH_MAX)
+ * are sanitized.  Returns 1 if an entry was read, 0 at the end of the
+ * archive and -1 on error.
+ */
+static int reader_next_entry(TarReader *r, const char *archive, TarHeader *header,
+        char *name, char *linkname)
+{
+    // Long names and pax records apply to the header that follows them.
+    int have_name = 0;
+    int have_linkname = 0;
+    for (;;) {
+        if (reader_read(r, (char *)header, TAR_BLOCK_SIZE))
+            return -1;
+        if (header->name[0] == '\0' && header_checksum(header) == 8 * ' ') {
+            // End of archive marker.
+            return 0;
+        }
+        if (get_number(header->chksum, sizeof(header->chksum)) != header_checksum(header)) {
+            printf("bad header checksum in %s\n", archive);
+            return -1;
+        }
+
+        uint64_t size = get_number(header->size, sizeof(header->size));
+        if (header->typeflag == TAR_TYPE_GNU_LONGNAME) {
+            if (read_long_name(r, name, size))
+                return -1;
+            have_name = 1;
+            continue;
+        }
+        if (header->typeflag == TAR_TYPE_GNU_LONGLINK) {
+            if (read_long_name(r, linkname, size))
+                return -1;
+            have_linkname = 1;
+            continue;
+        }
+        if (header->typeflag == TAR_TYPE_PAX_HEADER) {
+            name[0] = linkname[0] = '\0';
+            if (read_pax_header(r, name, linkname, size))
+                return -1;
+            have_name = name[0] != '\0';
+            have_linkname = linkname[0] != '\0';
+            continue;
+        }
+        if (header->typeflag == TAR_TYPE_PAX_GLOBAL) {
+            if (reader_read(r, NULL, size) || reader_skip_padding(r, size))
+                return -1;
+            continue;
+        }
+
+        if (!have_name) {
+            if (memcmp(header->magic, "ustar", 6) == 0 && header->prefix[0] != '\0')
+                snprintf(name, PATH_MAX, "%.*s/%.*s",
+                        (int)sizeof(header->prefix), header->prefix,
+                        (int)sizeof(header->name), header->name);
+            else
+                snprintf(name, PATH_MAX, "%.*s", (int)sizeof(header->name), header->name);
+        }
+        if (!have_linkname)
+            snprintf(linkname, PATH_MAX, "%.*s",
+                    (int)sizeof(header->linkname), header->linkname);
+        have_name = have_linkname = 0;
+
+        if (sanitize_name(name)) {
+            printf("refusing to extract %s\n", name);
+            return -1;
+        }
+        if (header->typeflag == TAR_TYPE_HARDLINK && sanitize_name(linkname)) {
+            printf("refusing to link to %s\n", linkname);
+            return -1;
+        }
+        if (name[0] == '\0') {
+            // "./" itself
+            if (reader_read(r, NULL, size) || reader_skip_padding(r, size))
+                return -1;
+            continue;
+        }
+        return 1;
+    }
+}
+
+// Skip the data of an entry that isn't extracted.
+static int reader_skip_entry(TarReader *r, const TarHeader *header)
+{
+    if (header->typeflag == TAR_TYPE_HARDLINK || header->typeflag == TAR_TYPE_SYMLINK)
+        return 0;
+    uint64_t size = get_number(header->size, sizeof(header->size));
+    return reader_read(r, NULL, size) || reader_skip_padding(r, size);
+}
+
+int tar_extract(const char *archive, const char *directory,
+        const char **excludes, int flags,
+        tar_progress_callback callback, void *cookie)
+{
+    TarReader r;
+    if (reader_open(&r, archive))
+        return -1;
+    r.flags = flags;
+    r.excludes = excludes;
+    if ((flags & TAR_DELTA) && (r.names = mzHashTableCreate(4096, free)) == NULL) {
+        reader_close(&r);
+        return -1;
+    }
+
+    TarHeader header;
+    char name[PATH_MAX];
+    char linkname[PATH_MAX];
+    int ret;
+    while ((ret = reader_next_entry(&r, archive, &header, name, linkname)) > 0) {
+        if ((r.names != NULL && remember_name(&r, name)) ||
+                extract_entry(&r, directory, &header, name, linkname)) {
+            ret = -1;
+            break;
+        }
+
+        r.files++;
+        if (callback != NULL)
+            callback(name, r.bytes, r.files, cookie);
+    }
+
+    if (ret == 0 && r.names != NULL) {
+        RemoveExtrasArgs args = { &r, directory, 0 };
+        mzHashForeach(r.names, remove_extras_below_root, &args);
+        ret = args.ret;
+    }
+
+    reader_close(&r);
+    return ret;
+}
+
+/*
+ * Archive index.
+ *
+ * archive.idx is a text file: a version line, then an "e <offset>
+ * <size> <name>" line for every entry, where offset is the position of
+ * the entry's first header in the uncompressed archive and directory
+ * names end in '/'.  Compressed archives also get an "m <offset>" line
+ * for every gzip member, in order; member n holds the uncompressed
+ * data from n * BLOCKGZ_BLOCK_SIZE on.
+ */
+
+static FILE *reader_open_index(TarReader *r, const char *archive)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.idx", archive);
+    FILE *index = fopen(path, "r");
+    if (index == NULL)
+        return NULL;
+
+    char line[PATH_MAX + 64];
+    if (fgets(line, sizeof(line), index) == NULL ||
+            strncmp(line, TAR_INDEX_VERSION "\n", sizeof(TAR_INDEX_VERSION)) != 0) {
+        printf("ignoring unknown index %s\n", path);
+        fclose(index);
+        return NULL;
+    }
+    long entries = ftell(index);
+    if (r->gz != NULL) {
+        int capacity = 0;
+        unsigned long long offset;
+        while (fgets(line, sizeof(line), index) != NULL) {
+            if (sscanf(line, "m %llu", &offset) != 1)
+                continue;
+            if (r->num_members == capacity) {
+                capacity = capacity == 0 ? 256 : capacity * 2;
+                uint64_t *members = (uint64_t *)realloc(r->members, capacity * sizeof(uint64_t));
+                if (members == NULL) {
+                    fclose(index);
+                    return NULL;
+                }
+                r->members = members;
+            }
+            r->members[r->num_members++] = offset;
+        }
+    }
+    fseek(index, entries, SEEK_SET);
+    return index;
+}
+
+// Read the next entry of the index.  Returns 0 at the end.
+static int index_next_entry(FILE *index, uint64_t *offset, uint64_t *size, char *name)
+{
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), index) != NULL) {
+        unsigned long long o, s;
+        int n;
+        if (sscanf(line, "e %llu %llu %n", &o, &s, &n) != 2)
+            continue;
+        size_t len = strcspn(line + n, "\n");
+        if (len >= PATH_MAX)
+            continue;
+        memcpy(name, line + n, len);
+        name[len] = '\0';
+        *offset = o;
+        *size = s;
+        return 1;
+    }
+    return 0;
+}
+
+// Position the reader at offset in the uncompressed archive.
+static int reader_seek(TarReader *r, uint64_t offset)
+{
+    uint64_t pos = r->base + r->pos;
+    if (offset >= pos && offset - pos < TAR_SEEK_DISTANCE)
+        return reader_read(r, NULL, offset - pos);
+
+    uint64_t base = offset;
+    if (r->gz != NULL) {
+        uint64_t member = offset / BLOCKGZ_BLOCK_SIZE;
+        if (member >= (uint64_t)r->num_members) {
+            printf("index doesn't match archive\n");
+            return -1;
+        }
+        base = member * BLOCKGZ_BLOCK_SIZE;
+        blockgz_close_reader(r->gz);
+        r->gz = NULL;
+        if (lseek(r->fd, r->members[member], SEEK_SET) < 0 ||
+                (r->gz = blockgz_open_reader(r->fd)) == NULL)
+            return -1;
+    } else if (lseek(r->fd, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    r->base = base;
+    r->pos = r->len = 0;
+    return reader_read(r, NULL, offset - base);
+}
+
+static int is_selected(const char **paths, const char *name)
+{
+    const char **path;
+    for (path = paths; *path != NULL; path++) {
+        size_t len = strlen(*path);
+        if (strncmp(name, *path, len) == 0 && (name[len] == '\0' || name[len] == '/'))
+            return 1;
+    }
+    return 0;
+}
+
+int tar_list(const char *archive, tar_list_callback callback, void *cookie)
+{
+    TarReader r;
+    if (reader_open(&r, archive))
+        return -1;
+
+    char name[PATH_MAX];
+    int ret = 0;
+    FILE *index = reader_open_index(&r, archive);
+    if (index != NULL) {
+        uint64_t offset, size;
+        while (index_next_entry(index, &offset, &size, name))
+            callback(name, size, cookie);
+        fclose(index);
+    } else {
+        // no index, read through the whole archive
+        TarHeader header;
+        char linkname[PATH_MAX];
+        while ((ret = reader_next_entry(&r, archive, &header, name, linkname)) > 0) {
+            uint64_t size = get_number(header.size, sizeof(header.size));
+            size_t len = strlen(name);
+            if (header.typeflag == TAR_TYPE_DIR && len + 1 < sizeof(name))
+                strcpy(name + len, "/");
+            else if (header.typeflag == TAR_TYPE_HARDLINK || header.typeflag == TAR_TYPE_SYMLINK)
+                size = 0;
+            callback(name, size, cookie);
+            if (reader_skip_entry(&r, &header)) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    reader_close(&r);
+    return ret;
+}
+
+static void free_paths(char **paths)
+{
+    char **path;
+    for (path = paths; *path != NULL; path++)
+        free(*path);
+    free(paths);
+}
+
+int tar_extract_paths(const char *archive, const char *directory,
+        const char **paths, tar_progress_callback callback, void *cookie)
+{
+    // match the paths against names the way they are stored
+    int count;
+    for (count = 0; paths[count] != NULL; count++)
+        ;
+    char **selected = (char **)calloc(count + 1, sizeof(char *));
+    if (selected == NULL)
+        return -1;
+    int i;
+    for (i = 0; i < count; i++) {
+        if ((selected[i] = strdup(paths[i])) == NULL || sanitize_name(selected[i])) {
+            printf("invalid path %s\n", paths[i]);
+            free_paths(selected);
+            return -1;
+        }
+    }
+
+    TarReader r;
+    if (reader_open(&r, archive)) {
+        free_paths(selected);
+        return -1;
+    }
+
+    TarHeader header;
+    char name[PATH_MAX];
+    char linkname[PATH_MAX];
+    int ret = 0;
+    FILE *index = reader_open_index(&r, archive);
+    if (index != NULL) {
+        uint64_t offset, size;
+        char entry[PATH_MAX];
+        while (ret == 0 && index_next_entry(index, &offset, &size, entry)) {
+            size_t len = strlen(entry);
+            if (len > 0 && entry[len - 1] == '/')
+                entry[len - 1] = '\0';
+            if (!is_selected((const char **)selected, entry))
+                continue;
+            if (reader_seek(&r, offset) ||
+                    reader_next_entry(&r, archive, &header, name, linkname) <= 0 ||
+                    extract_entry(&r, directory, &header, name, linkname)) {
+                ret = -1;
+                break;
+            }
+            r.files++;
+            if (callback != NULL)
+                callback(name, r.bytes, r.files, cookie);
+        }
+        fclose(index);
+    } else {
+        // no index, read through the whole archive
+        while ((ret = reader_next_entry(&r, archive, &header, name, linkname)) > 0) {
+            if (!is_selected((const char **)selected, name)) {
+                if (reader_skip_entry(&r, &header)) {
+                    ret = -1;
+                    break;
+                }
+                continue;
+            }
+            if (extract_entry(&r, directory, &header, name, linkname)) {
+                ret = -1;
+                break;
+            }
+            r.files++;
+            if (callback != NULL)
+                callback(name, r.bytes, r.files, cookie);
+        }
+    }
+    if (ret == 0 && r.files == 0) {
+        printf("%s not found in %s\n", paths[0], archive);
+        ret = -1;
+    }
+
+    reader_close(&r);
+    free_paths(selected);
+    return ret;
+}
@@ -0,0 +1,86 @@
+#ifndef TARUTILS_H_
+#define TARUTILS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Invoked once for every entry that was archived or extracted.
+ * filename is the name of the entry inside the archive, bytes is
+ * the running total of file data processed so far and files the
+ * running number of entries.
+ */
+typedef void (*tar_progress_callback)(const char *filename,
+        uint64_t bytes, int files, void *cookie);
+
+/* Invoked with every chunk of the archive file, in order, as it is
+ * written out, so that the archive can be checksummed without reading
+ * it back.
+ */
+typedef void (*tar_output_callback)(const void *data, size_t len, void *cookie);
+
+/* Invoked for every entry by tar_list.  Directory names end in '/'. */
+typedef void (*tar_list_callback)(const char *name, uint64_t size, void *cookie);
+
+/* Archive the tree at directory into a new tar file, equivalent to
+ * "cd $(dirname directory) ; tar cf archive $(basename directory)":
+ * entry names begin with the last component of directory.
+ *
+ * excludes is a NULL terminated list of entry names (eg "data/media")
+ * that are skipped along with everything below them.  It may be NULL.
+ *
+ * With TAR_GZIP in flags the archive is gzip compressed on all cores
+ * (see blockgz.h).  With TAR_INDEX an index of entry offsets is
+ * written to archive + ".idx", which lets tar_list and
+ * tar_extract_paths go straight to the entries they need.
+ *
+ * output and callback may be NULL; both receive cookie.
+ *
+ * Returns 0 on success.
+ */
+#define TAR_GZIP    1
+#define TAR_INDEX   8
+
+int tar_create(const char *archive, const char *directory,
+        const char **excludes, int flags, tar_output_callback output,
+        tar_progress_callback callback, void *cookie);
+
+/* Extract every entry of archive below directory, equivalent to
+ * "cd directory ; tar xf archive".  Gzip compressed archives are
+ * detected automatically.  Ownership, permissions and
+ * modification times are restored.  GNU long names and pax path
+ * records written by busybox or GNU tar are understood.
+ *
+ * With TAR_DELTA in flags directory is assumed to hold an older copy of
+ * the same tree and is brought up to date in place: entries whose type,
+ * size and modification time already match are left untouched, and
+ * anything below the archived top level directories that the archive
+ * doesn't contain is deleted, except for excludes (as for tar_create,
+ * may be NULL).  TAR_DELTA_CONTENT additionally compares the contents
+ * of every file that exists and only rewrites the blocks that differ.
+ *
+ * Returns 0 on success.
+ */
+#define TAR_DELTA           2
+#define TAR_DELTA_CONTENT   4
+
+int tar_extract(const char *archive, const char *directory,
+        const char **excludes, int flags,
+        tar_progress_callback callback, void *cookie);
+
+/* List the entries of archive, from its index if it has one.
+ *
+ * Returns 0 on success.
+ */
+int tar_list(const char *archive, tar_list_callback callback, void *cookie);
+
+/* Extract only the entries named in paths, a NULL terminated list of
+ * entry names (eg "data/app"), and everything below them.  With an
+ * index this costs about as much as the selected data; without one the
+ * whole archive is read.
+ *
+ * Returns 0 on success, -1 on error or if nothing matched.
+ */
+int tar_extract_paths(const char *archive, const char *directory,
+        const char **paths, tar_progress_callback callback, void *cookie);
+
+#endif  // TARUTILS_H_
@@ -360,7 +360,8 @@ Value* PackageExtractDirFn(const char* name, State* state,
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
     bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                      MZ_EXTRACT_FILES_ONLY |
+                                      MZ_EXTRACT_PARALLEL, &timestamp,
                                       NULL, NULL);
     free(zip_path);
     free(dest_path);